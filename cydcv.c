@@ -7,9 +7,21 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* external libs */
 #include <curl/curl.h>
+#include <zlib.h>
 #include <yajl/yajl_parse.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -18,6 +30,8 @@
 #define _cleanup_(x) __attribute__((cleanup(x)))
 #define _cleanup_free_ _cleanup_(freep)
 static inline void freep(void *p) { free(*(void**) p); }
+#define _cleanup_curl_free_ _cleanup_(curl_freep)
+static inline void curl_freep(void *p) { curl_free(*(void**) p); }
 
 // API KEY from ydcv
 #define API "YouDaoCV"
@@ -27,6 +41,44 @@ static inline void freep(void *p) { free(*(void**) p); }
 #define YD_BASE_URL "http://fanyi.youdao.com"
 #define YD_API_URL	YD_BASE_URL "/openapi.do?keyfrom=%s&key=%s&type=data&doctype=json&version=%s&q=%s"
 
+/* result cache policy, in seconds */
+#define CACHE_TTL			(7 * 24 * 60 * 60)
+#define CACHE_NEGATIVE_TTL	(5 * 60)
+#define CACHE_MAX_ENTRIES	4096
+#define CACHE_BUCKETS		8192
+#define CACHE_COMPACT_INTERVAL	10
+
+/* metrics export */
+#define METRICS_INTERVAL	10
+#define HIST_SUB_BITS		3
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/* readline history kept by the interactive prompt */
+#define HISTORY_MAX			1000
+
+/* concurrent transfers for batched lookups, a batch of up to
+ * FETCH_MAX_BURST words (a glossed sentence and its unique words) goes
+ * out in one round trip, larger ones FETCH_MAX_PARALLEL at a time */
+#define FETCH_MAX_PARALLEL	16
+#define FETCH_MAX_BURST		64
+
+/* worker threads for parsing and rendering, per worker queue length */
+#define POOL_MAX_WORKERS	16
+#define POOL_QUEUE_SIZE		256
+
+/* widest gloss shown under a word, in columns */
+#define GLOSS_MAX_WIDTH		20
+
+/* shared on-disk cache */
+#define STORE_MAGIC			0x53564443	/* "CDVS" */
+#define STORE_RECORD_MAGIC	0x52564443	/* "CDVR" */
+#define STORE_VERSION		2
+#define STORE_SLOTS			(1 << 14)
+#define STORE_MAP_SIZE		(1ULL << 30)
+#define STORE_COMPACT_MIN	(1 << 20)
+#define STORE_DEFLATE_MIN	128
+#define STORE_DEFLATE_WBITS	12	/* 4KiB window, values are a few KiB */
+
 #define NC                    "\033[0m"
 #define BOLD                  "\033[1m"
 #define UNDERLINE             "\033[4m"
@@ -65,6 +117,15 @@ typedef enum __loglevel_t {
 enum {
 	OP_DEBUG = 1000,
 	OP_VERBOSE,
+	OP_CACHE_FILE,
+	OP_MEM_STATS,
+	OP_BACKEND,
+	OP_ROUTE,
+	OP_METRICS_FILE,
+	OP_METRICS_SOCKET,
+	OP_JOBS,
+	OP_RECORD,
+	OP_REPLAY,
 };
 
 struct list_t {
@@ -76,6 +137,51 @@ typedef struct list_t list_t;
 typedef void (*list_fn_free)(void *); /* item deallocation callback */
 typedef int (*list_fn_cmp)(const void *, const void *); /* item comparsion callback */
 
+/* every tracked allocation is prefixed with its size and owner */
+enum mem_subsys_t {
+	MEM_PARSER,
+	MEM_RESULT,
+	MEM_CACHE,
+	MEM_CONNECTION,
+	MEM_SUBSYS_MAX,
+};
+typedef enum mem_subsys_t mem_subsys_t;
+
+struct mem_header_t {
+	size_t size;
+	mem_subsys_t subsys;
+} __attribute__((aligned(16)));
+typedef struct mem_header_t mem_header_t;
+
+enum metric_counter_t {
+	METRIC_LOOKUPS,
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_STALE_HITS,
+	METRIC_CACHE_MISSES,
+	METRIC_CACHE_REFRESHES,
+	METRIC_RETRIES,
+	METRIC_FETCH_ERRORS,
+	METRIC_COUNTER_MAX,
+};
+typedef enum metric_counter_t metric_counter_t;
+
+enum metric_histogram_t {
+	METRIC_LOOKUP,
+	METRIC_FETCH,
+	METRIC_PARSE,
+	METRIC_RENDER,
+	METRIC_HISTOGRAM_MAX,
+};
+typedef enum metric_histogram_t metric_histogram_t;
+
+/* log-linear buckets of microseconds, 2^HIST_SUB_BITS per power of two */
+struct histogram_t {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+};
+typedef struct histogram_t histogram_t;
+
 enum json_key_type_t {
 	JSON_KEY_METADATA,
 	JSON_KEY_BASIC_DIC,
@@ -90,51 +196,320 @@ struct key_t {
 	size_t offset;
 };
 
-struct basic_dic_t {
-	char *us_phonetic;
-	char *phonetic;
-	char *uk_phonetic;
+struct buffer_t {
+	char *data;
+	size_t len;
+	size_t size;
+};
+typedef struct buffer_t buffer_t;
+
+/* A parsed result is one contiguous, position independent buffer: this
+ * header, a table of NUL terminated strings and arrays of uint32_t
+ * offsets, all relative to the start of the header. An offset of 0 means
+ * the field is absent. The same bytes are kept in memory, written to the
+ * shared cache and rendered from, without any conversion. */
+#define RESULT_MAGIC		0x46564443	/* "CDVF" */
+#define RESULT_VERSION		1
+
+enum {
+	RESULT_HAS_BASIC = 1,
+};
 
-	char *us_speech;
-	char *speech;
-	char *uk_speech;
+struct result_range_t {
+	uint32_t offset;
+	uint32_t count;
+};
+typedef struct result_range_t result_range_t;
 
-	list_t *explains;
+struct result_web_t {
+	uint32_t key;
+	result_range_t value;
 };
-typedef struct basic_dic_t basic_dic_t;
+typedef struct result_web_t result_web_t;
+
+struct result_t {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t size;
+	int32_t errorcode;
+
+	uint32_t query;
+
+	uint32_t us_phonetic;
+	uint32_t phonetic;
+	uint32_t uk_phonetic;
 
-struct web_dic_t {
-	list_t *value;
-	char *key;
+	uint32_t us_speech;
+	uint32_t speech;
+	uint32_t uk_speech;
+
+	result_range_t translation;
+	result_range_t explains;
+	result_range_t web;
 };
-typedef struct web_dic_t web_dic_t;
+typedef struct result_t result_t;
 
 struct json_parser_t {
 	const struct key_t *key;
-
-	list_t *translation;
-	basic_dic_t *basic_dic;
 	int depth;
 
-	char *query;
-	int errorcode;
-	web_dic_t web_dic;
-	list_t *web_dic_list;
+	/* the result being built, starts with a result_t */
+	buffer_t result;
+
+	/* offset arrays, appended to the result when parsing is done */
+	buffer_t translation;
+	buffer_t explains;
+	buffer_t web_values;
+	buffer_t web;
+	result_web_t web_dic;
 };
 typedef struct json_parser_t json_parser_t;
 
+/* On-disk layout: header, slot table, then an append-only record log.
+ * Readers only do atomic loads on the mapping; writers reserve log space
+ * with an atomic add on log_end, pwrite() the record and then publish its
+ * offset in the slot table. Compaction writes a new file, rename()s it in
+ * place and marks the old one retired, so mappings of the old file stay
+ * valid until their owners notice and reopen. Values are result_t
+ * buffers, deflated per record when that makes them smaller. */
+struct store_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t retired;
+	uint64_t log_start;
+	uint64_t log_end;
+	uint64_t live;
+	uint64_t dead_bytes;
+};
+typedef struct store_header_t store_header_t;
+
+struct store_slot_t {
+	uint64_t hash;
+	uint64_t offset;
+};
+typedef struct store_slot_t store_slot_t;
+
+/* what store_open may do with a file that is not a usable store */
+enum {
+	/* rebuild it if it is a store of ours, from an older version or damaged */
+	STORE_OPEN_RECREATE = 1,
+	/* the path belongs to us, rebuild whatever is there */
+	STORE_OPEN_OWNED = 2,
+	/* mapped with store_open_readonly, reopened the same way */
+	STORE_OPEN_READONLY = 4,
+};
+
+enum {
+	STORE_NEGATIVE = 1,
+	/* value is a uint32_t raw length followed by a raw deflate stream */
+	STORE_DEFLATE = 2,
+};
+
+struct store_record_t {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t keylen;
+	uint32_t vallen;
+	int64_t fetched;
+	int32_t errorcode;
+	uint32_t checksum;
+	uint64_t hash;
+	/* key, NUL and the aligned value follow */
+};
+typedef struct store_record_t store_record_t;
+
+struct store_t {
+	char *path;
+	int flags;
+	int fd;
+	uint8_t *map;
+	store_header_t *hdr;
+	store_slot_t *slots;
+
+	/* file size last seen, only the mapping below it may be touched */
+	uint64_t size;
+	/* for a compacted store, how far the log of the old one was copied */
+	uint64_t copied;
+};
+typedef struct store_t store_t;
+
+/* A corpus is a store of raw API responses keyed by query. It is only
+ * ever appended to, so a query that was recorded again is found with
+ * its newest response and the older ones stay in the log. Values are
+ * this header followed by the body. */
+struct corpus_entry_t {
+	int64_t recorded;
+	int32_t httpcode;
+	uint32_t bodylen;
+	/* microseconds */
+	uint64_t total;
+	uint64_t parsing;
+};
+typedef struct corpus_entry_t corpus_entry_t;
+
+struct transfer_t {
+	CURL *curl;
+	struct yajl_handle_t *hand;
+	json_parser_t parser;
+	char *url;
+	char *word;
+
+	/* timings in microseconds */
+	uint64_t started;
+	uint64_t parsing;
+
+	/* body kept for a worker to parse instead of streaming into hand,
+	 * or also teed into it for the corpus */
+	bool buffered;
+	bool recording;
+	buffer_t body;
+};
+typedef struct transfer_t transfer_t;
+
+/* a unit of CPU work handed to the pool */
+struct task_t {
+	void (*run)(void *arg);
+	void *arg;
+};
+typedef struct task_t task_t;
+
+struct pool_cell_t {
+	size_t seq;
+	task_t task;
+};
+typedef struct pool_cell_t pool_cell_t;
+
+/* Bounded multi-producer multi-consumer ring. A cell's sequence number
+ * says whether it is free for the producer at that position or ready
+ * for the consumer, so push and pop are one CAS on their own index.
+ * Every worker owns one and steals from the others when it runs dry. */
+struct pool_queue_t {
+	pool_cell_t cells[POOL_QUEUE_SIZE];
+	size_t enqueue_pos __attribute__((aligned(64)));
+	size_t dequeue_pos __attribute__((aligned(64)));
+};
+typedef struct pool_queue_t pool_queue_t;
+
+/* completion of a group of tasks */
+struct latch_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t remaining;
+};
+typedef struct latch_t latch_t;
+
+struct parse_job_t {
+	buffer_t body;
+	result_t **result;
+	latch_t *latch;
+};
+typedef struct parse_job_t parse_job_t;
+
+struct render_job_t {
+	const result_t *result;
+	char *out;
+	size_t len;
+	bool done;
+	latch_t *latch;
+};
+typedef struct render_job_t render_job_t;
+
+struct token_t {
+	const char *text;
+	size_t len;
+	int width;
+
+	/* index into the deduplicated words */
+	size_t word;
+};
+typedef struct token_t token_t;
+
+/* A backend turns a word into a result_t. Local backends answer without
+ * the network and their results are not written to the shared cache. */
+struct backend_t {
+	const char *name;
+	/* as given to --backend, tells apart backends of the same name */
+	char *spec;
+	bool local;
+	result_t *(*lookup)(struct backend_t *backend, CURL *curl, const char *word);
+	void (*lookup_many)(struct backend_t *backend, const char **words, size_t n,
+			result_t **results);
+	void (*free)(struct backend_t *backend);
+	void *data;
+	/* asked before the others whatever its latency, as --replay is */
+	bool pinned;
+	/* replay holds it to read data, refreshing data takes it for itself */
+	pthread_rwlock_t lock;
+	long delay;
+	/* mock: every this many lookups fail, 0 for never */
+	long fail_every;
+	uint64_t calls;
+
+	/* moving average in microseconds, 0 until first used */
+	uint64_t latency;
+	uint64_t requests;
+	uint64_t failures;
+};
+typedef struct backend_t backend_t;
+
+enum route_t {
+	ROUTE_FASTEST,
+	ROUTE_FANOUT,
+};
+typedef enum route_t route_t;
+
+/* one word sent to several backends, shared with their threads */
+struct fanout_t {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	int refs;
+	bool closed;
+
+	result_t *winner;
+	backend_t *winner_source;
+	result_t *fallback;
+	backend_t *fallback_source;
+	char *word;
+};
+typedef struct fanout_t fanout_t;
+
+struct fanout_job_t {
+	fanout_t *fanout;
+	backend_t *backend;
+};
+typedef struct fanout_job_t fanout_job_t;
+
+struct cache_entry_t {
+	char *word;
+	result_t *result;
+
+	/* metadata used by the refresh policy */
+	time_t fetched;
+	int errorcode;
+	bool negative;
+	bool refreshing;
+
+	/* recency list and hash chain */
+	struct cache_entry_t *prev;
+	struct cache_entry_t *next;
+	struct cache_entry_t *chain;
+};
+typedef struct cache_entry_t cache_entry_t;
+
 /* function prototypes */
 int json_end_map(void *ctx);
 int json_integer(void *ctx, long long val);
 int json_map_key(void *ctx, const unsigned char *data, size_t size);
 int json_start_map(void *ctx);
 int json_string(void *ctx, const unsigned char *data, size_t size);
-int json_string_webdic_multivalued(web_dic_t *dest, const unsigned char *data, size_t size);
-int json_string_multivalued(list_t **dest, const unsigned char *data, size_t size);
-int json_string_singlevalued(char **dest, const unsigned char *data, size_t size);
+int json_string_multivalued(buffer_t *dest, uint32_t offset);
+int json_string_singlevalued(uint32_t *dest, uint32_t offset);
 const struct key_t *string_to_key(const unsigned char *key, size_t len);
 static int cyd_asprintf(char**, const char*, ...) __attribute__((format(printf,2,3)));
-void print_explanation(json_parser_t *parser);
+void print_explanation(const result_t *result);
 
 /* runtime configuration */
 static struct {
@@ -143,11 +518,121 @@ static struct {
 	int color;
 	bool selection;
 	bool speech;
+	bool gloss;
+	bool mem_stats;
+
+	char *cache_file;
+	char *backends;
+	route_t route;
+	char *metrics_file;
+	char *metrics_socket;
+	int jobs;
+	char *record;
+	char *replay;
 
 	list_t *words;
 } cfg;
 
 /* globals */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int refreshing;
+	bool compacting;
+	time_t compacted;
+
+	/* most recently used first, found through the hash buckets */
+	cache_entry_t *head;
+	cache_entry_t *tail;
+	cache_entry_t *buckets[CACHE_BUCKETS];
+	size_t count;
+	store_t *store;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int inflight;
+
+	/* backend_t */
+	list_t *backends;
+} router = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	0,
+	NULL,
+};
+
+static struct {
+	pool_queue_t *queues;
+	pthread_t *threads;
+	size_t nworkers;
+	size_t nthreads;
+
+	/* round robin start for submitters outside the pool */
+	size_t next;
+	/* queued tasks, may dip below zero while a push is being counted */
+	long pending;
+	long sleepers;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+/* index of the worker running on this thread */
+static __thread int pool_self = -1;
+
+/* responses are recorded here with --record, recorders share the lock
+ * and growing the corpus takes it for itself */
+static store_t *corpus;
+static pthread_rwlock_t corpus_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* where cyd_printf output goes on this thread, stdout when NULL */
+static __thread FILE *cyd_out;
+
+static struct {
+	uint64_t counters[METRIC_COUNTER_MAX];
+	int64_t inflight;
+	histogram_t histograms[METRIC_HISTOGRAM_MAX];
+
+	pthread_t thread;
+	bool running;
+	int wakeup[2];
+	int listen_fd;
+} metrics;
+
+static const struct {
+	const char *name;
+	const char *help;
+} metric_counters[METRIC_COUNTER_MAX] = {
+	{ "cydcv_lookups_total",			"Lookups requested." },
+	{ "cydcv_cache_hits_total",			"Lookups answered by a fresh cache entry." },
+	{ "cydcv_cache_stale_hits_total",	"Lookups answered by a stale entry while it is refreshed." },
+	{ "cydcv_cache_misses_total",		"Lookups that had to go to a backend." },
+	{ "cydcv_cache_refreshes_total",	"Background refreshes of stale entries." },
+	{ "cydcv_retries_total",			"Lookups repeated on another backend." },
+	{ "cydcv_fetch_errors_total",		"Transfers that failed or got an HTTP error." },
+}, metric_histograms[METRIC_HISTOGRAM_MAX] = {
+	{ "cydcv_lookup",	"Time to look up and print a query." },
+	{ "cydcv_fetch",	"Time for an HTTP transfer to complete." },
+	{ "cydcv_parse",	"Time spent parsing a response." },
+	{ "cydcv_render",	"Time spent printing a result." },
+};
+
+static size_t mem_live[MEM_SUBSYS_MAX];
+static const char *mem_subsys_names[MEM_SUBSYS_MAX] = {
+	"parser",
+	"results",
+	"cache",
+	"connections",
+};
+
 static yajl_callbacks callbacks = {
     NULL,			/* null */
     NULL,			/* boolean */
@@ -162,21 +647,23 @@ static yajl_callbacks callbacks = {
     NULL,			/* end_array */
 };
 
-/* list must be sorted by the string value */
+/* list must be sorted by the string value
+ * single values are offsets into result_t (result_web_t for web keys),
+ * multiple values are offsets of the collecting buffer in json_parser_t */
 static const struct key_t json_keys[] = {
 	{ "basic",			JSON_KEY_BASIC_DIC,	0, 0 },
-	{ "errorcode",		JSON_KEY_METADATA,	0, offsetof(json_parser_t, errorcode) },
-	{ "explains",		JSON_KEY_BASIC_DIC, 1, offsetof(basic_dic_t, explains) },
-	{ "key",			JSON_KEY_WEB_DIC,	0, offsetof(web_dic_t, key) },
-	{ "phonetic",		JSON_KEY_BASIC_DIC,	0, offsetof(basic_dic_t, phonetic) },
-	{ "query",			JSON_KEY_METADATA,	0, offsetof(json_parser_t, query) },
-	{ "speech",			JSON_KEY_BASIC_DIC,	0, offsetof(basic_dic_t, speech) },
+	{ "errorcode",		JSON_KEY_METADATA,	0, offsetof(result_t, errorcode) },
+	{ "explains",		JSON_KEY_BASIC_DIC, 1, offsetof(json_parser_t, explains) },
+	{ "key",			JSON_KEY_WEB_DIC,	0, offsetof(result_web_t, key) },
+	{ "phonetic",		JSON_KEY_BASIC_DIC,	0, offsetof(result_t, phonetic) },
+	{ "query",			JSON_KEY_METADATA,	0, offsetof(result_t, query) },
+	{ "speech",			JSON_KEY_BASIC_DIC,	0, offsetof(result_t, speech) },
 	{ "translation",	JSON_KEY_METADATA,	1, offsetof(json_parser_t, translation) },
-	{ "uk-phonetic",	JSON_KEY_BASIC_DIC,	0, offsetof(basic_dic_t, uk_phonetic) },
-	{ "uk-speech",		JSON_KEY_BASIC_DIC,	0, offsetof(basic_dic_t, uk_speech) },
-	{ "us-phonetic",	JSON_KEY_BASIC_DIC,	0, offsetof(basic_dic_t, us_phonetic) },
-	{ "us-speech",		JSON_KEY_BASIC_DIC, 0, offsetof(basic_dic_t, us_speech) },
-	{ "value",			JSON_KEY_WEB_DIC,	1, offsetof(web_dic_t, value) },
+	{ "uk-phonetic",	JSON_KEY_BASIC_DIC,	0, offsetof(result_t, uk_phonetic) },
+	{ "uk-speech",		JSON_KEY_BASIC_DIC,	0, offsetof(result_t, uk_speech) },
+	{ "us-phonetic",	JSON_KEY_BASIC_DIC,	0, offsetof(result_t, us_phonetic) },
+	{ "us-speech",		JSON_KEY_BASIC_DIC, 0, offsetof(result_t, us_speech) },
+	{ "value",			JSON_KEY_WEB_DIC,	1, offsetof(json_parser_t, web_values) },
 	{ "web",			JSON_KEY_WEB_DIC,	0, 0 },
 };
 
@@ -232,7 +719,7 @@ int cyd_printf(loglevel_t level, COLOR color, const char *format, ...)
     va_list args;
 
     va_start(args, format);
-    ret = cyd_vfprintf(stdout, level, color, format, args);
+    ret = cyd_vfprintf(cyd_out ? cyd_out : stdout, level, color, format, args);
     va_end(args);
 
     return ret;
@@ -250,452 +737,3773 @@ int cyd_fprintf(FILE *stream, loglevel_t level, const char *format, ...)
     return ret;
 }
 
+uint64_t now_usec(void)
+{
+	struct timespec ts;
 
-// linked list implemention from libalpm
-list_t *list_add(list_t *list, void *data)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_inc(metric_counter_t counter)
 {
-	list_t *ptr, *lp;
+	__atomic_fetch_add(&metrics.counters[counter], 1, __ATOMIC_RELAXED);
+}
 
-	ptr = malloc(sizeof(list_t));
-	if (ptr == NULL)
-		return list;
+size_t histogram_index(uint64_t value)
+{
+	int msb = 63 - __builtin_clzll(value | 1);
+	int shift;
 
-	ptr->data = data;
-	ptr->next = NULL;
+	if (msb < HIST_SUB_BITS)
+		return value;
 
-	/* Special case: the input list is empty */
-	if (list == NULL) {
-		return ptr;
+	shift = msb - HIST_SUB_BITS;
+	return ((size_t)(shift + 1) << HIST_SUB_BITS) +
+		((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* largest value that falls into bucket i */
+uint64_t histogram_bucket_max(size_t i)
+{
+	size_t shift;
+
+	if (i < (1 << HIST_SUB_BITS))
+		return i;
+
+	shift = (i >> HIST_SUB_BITS) - 1;
+	return (((uint64_t)(1 << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1)) + 1) << shift) - 1;
+}
+
+void histogram_observe(metric_histogram_t h, uint64_t usec)
+{
+	histogram_t *hist = &metrics.histograms[h];
+
+	__atomic_fetch_add(&hist->buckets[histogram_index(usec)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+/* observe the time since start */
+void histogram_since(metric_histogram_t h, uint64_t start)
+{
+	histogram_observe(h, now_usec() - start);
+}
+
+uint64_t histogram_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+	uint64_t seen = 0, rank = (uint64_t)(q * count);
+	size_t i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen > rank)
+			return histogram_bucket_max(i);
 	}
 
-	lp = list;
-	while (lp->next)
-		lp = lp->next;
+	return 0;
+}
 
-	lp->next = ptr;
-	return list;
+/* a label value, escaped as the text exposition format wants it */
+void metrics_write_label(FILE *out, const char *name, const char *value)
+{
+	fprintf(out, "{%s=\"", name);
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', out);
+		if (*value == '\n')
+			fputs("\\n", out);
+		else
+			fputc(*value, out);
+	}
+	fputs("\"}", out);
 }
 
-void list_free(list_t *list)
+void metrics_write_histogram(FILE *out, metric_histogram_t h)
 {
-	list_t *it = list;
+	static const double bounds[] = {
+		0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+		0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+	};
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	const char *name = metric_histograms[h].name;
+	histogram_t *hist = &metrics.histograms[h];
+	uint64_t buckets[HIST_BUCKETS], count = 0, cumulative = 0;
+	size_t i, b = 0;
+
+	/* a consistent enough snapshot, count is derived from the buckets */
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
 
-	while (it) {
-		list_t *tmp = it->next;
-		free(it);
-		it = tmp;
+	fprintf(out, "# HELP %s_duration_seconds %s\n", name, metric_histograms[h].help);
+	fprintf(out, "# TYPE %s_duration_seconds histogram\n", name);
+	for (i = 0; i < HIST_BUCKETS && b < sizeof(bounds) / sizeof(bounds[0]); i++) {
+		while (b < sizeof(bounds) / sizeof(bounds[0]) &&
+				histogram_bucket_max(i) > bounds[b] * 1000000) {
+			fprintf(out, "%s_duration_seconds_bucket{le=\"%g\"} %lu\n", name, bounds[b],
+					(unsigned long)cumulative);
+			b++;
+		}
+		cumulative += buckets[i];
 	}
+	fprintf(out, "%s_duration_seconds_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)count);
+	fprintf(out, "%s_duration_seconds_sum %.6f\n", name,
+			__atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / 1e6);
+	fprintf(out, "%s_duration_seconds_count %lu\n", name, (unsigned long)count);
+
+	fprintf(out, "# HELP %s_duration_quantile_seconds %s\n", name, metric_histograms[h].help);
+	fprintf(out, "# TYPE %s_duration_quantile_seconds gauge\n", name);
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		fprintf(out, "%s_duration_quantile_seconds{quantile=\"%g\"} %.6f\n", name, quantiles[i],
+				histogram_quantile(buckets, count, quantiles[i]) / 1e6);
 }
 
-void list_free_inner(list_t *list, list_fn_free fn)
+/* Prometheus text exposition format */
+void metrics_write(FILE *out)
 {
-	list_t *it = list;
+	list_t *it;
+	int i;
+
+	for (i = 0; i < METRIC_COUNTER_MAX; i++) {
+		fprintf(out, "# HELP %s %s\n", metric_counters[i].name, metric_counters[i].help);
+		fprintf(out, "# TYPE %s counter\n", metric_counters[i].name);
+		fprintf(out, "%s %lu\n", metric_counters[i].name,
+				(unsigned long)__atomic_load_n(&metrics.counters[i], __ATOMIC_RELAXED));
+	}
 
-	if (fn) {
-		while (it) {
-			if (it->data)
-				fn(it->data);
-			it = it->next;
+	fprintf(out, "# HELP cydcv_transfers_in_flight HTTP transfers in progress.\n");
+	fprintf(out, "# TYPE cydcv_transfers_in_flight gauge\n");
+	fprintf(out, "cydcv_transfers_in_flight %ld\n",
+			(long)__atomic_load_n(&metrics.inflight, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP cydcv_cache_entries Entries in the in-memory cache.\n");
+	fprintf(out, "# TYPE cydcv_cache_entries gauge\n");
+	fprintf(out, "cydcv_cache_entries %zu\n", __atomic_load_n(&cache.count, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP cydcv_memory_live_bytes Live heap bytes per subsystem.\n");
+	fprintf(out, "# TYPE cydcv_memory_live_bytes gauge\n");
+	for (i = 0; i < MEM_SUBSYS_MAX; i++)
+		fprintf(out, "cydcv_memory_live_bytes{subsystem=\"%s\"} %zu\n", mem_subsys_names[i],
+				__atomic_load_n(&mem_live[i], __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP cydcv_backend_latency_seconds Moving average latency per backend.\n");
+	fprintf(out, "# TYPE cydcv_backend_latency_seconds gauge\n");
+	for (it = router.backends; it; it = it->next) {
+		backend_t *backend = it->data;
+		fprintf(out, "cydcv_backend_latency_seconds");
+		metrics_write_label(out, "backend", backend->spec);
+		fprintf(out, " %.6f\n", __atomic_load_n(&backend->latency, __ATOMIC_RELAXED) / 1e6);
+	}
+	fprintf(out, "# HELP cydcv_backend_requests_total Lookups sent to each backend.\n");
+	fprintf(out, "# TYPE cydcv_backend_requests_total counter\n");
+	for (it = router.backends; it; it = it->next) {
+		backend_t *backend = it->data;
+		fprintf(out, "cydcv_backend_requests_total");
+		metrics_write_label(out, "backend", backend->spec);
+		fprintf(out, " %lu\n", (unsigned long)__atomic_load_n(&backend->requests, __ATOMIC_RELAXED));
+	}
+	fprintf(out, "# HELP cydcv_backend_failures_total Failed lookups per backend.\n");
+	fprintf(out, "# TYPE cydcv_backend_failures_total counter\n");
+	for (it = router.backends; it; it = it->next) {
+		backend_t *backend = it->data;
+		fprintf(out, "cydcv_backend_failures_total");
+		metrics_write_label(out, "backend", backend->spec);
+		fprintf(out, " %lu\n", (unsigned long)__atomic_load_n(&backend->failures, __ATOMIC_RELAXED));
+	}
+
+	for (i = 0; i < METRIC_HISTOGRAM_MAX; i++)
+		metrics_write_histogram(out, i);
+}
+
+/* replace the metrics file atomically, so readers never see half of it */
+void metrics_write_file(const char *path)
+{
+	_cleanup_free_ char *tmppath = NULL;
+	FILE *out;
+
+	if (cyd_asprintf(&tmppath, "%s.tmp", path) == -1)
+		return;
+
+	out = fopen(tmppath, "w");
+	if (out == NULL) {
+		cyd_fprintf(stderr, LOG_WARN, "failed to write metrics %s: %s\n", path, strerror(errno));
+		return;
+	}
+	metrics_write(out);
+	if (fclose(out) != 0 || rename(tmppath, path) < 0)
+		unlink(tmppath);
+}
+
+/* answer one client, with an HTTP response if it sent a request */
+void metrics_serve(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	_cleanup_free_ char *body = NULL;
+	size_t len = 0, off = 0;
+	bool http = false;
+	FILE *out;
+
+	if (poll(&pfd, 1, 100) > 0) {
+		char request[1024];
+		http = read(fd, request, sizeof(request)) > 0;
+	}
+
+	out = open_memstream(&body, &len);
+	if (out == NULL)
+		return;
+	metrics_write(out);
+	fclose(out);
+
+	if (http) {
+		char header[128];
+		int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n\r\n", len);
+		send(fd, header, n, MSG_NOSIGNAL);
+	}
+	/* a scraper hanging up early must not take the process down */
+	while (off < len) {
+		ssize_t n = send(fd, body + off, len - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+}
+
+void *metrics_thread(void *arg)
+{
+	uint64_t next = now_usec();
+
+	while (1) {
+		struct pollfd pfds[2] = {
+			{ metrics.wakeup[0], POLLIN, 0 },
+			{ metrics.listen_fd, POLLIN, 0 },
+		};
+		uint64_t now = now_usec();
+		int timeout = -1;
+
+		if (cfg.metrics_file) {
+			if (now >= next) {
+				metrics_write_file(cfg.metrics_file);
+				next = now + METRICS_INTERVAL * 1000000ULL;
+			}
+			timeout = (next - now) / 1000 + 1;
+		}
+
+		if (poll(pfds, metrics.listen_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR)
+			break;
+
+		if (pfds[0].revents)
+			break;
+
+		if (metrics.listen_fd >= 0 && (pfds[1].revents & POLLIN)) {
+			int fd = accept4(metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0) {
+				metrics_serve(fd);
+				close(fd);
+			}
 		}
 	}
+
+	return NULL;
+}
+
+int metrics_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		cyd_fprintf(stderr, LOG_ERROR, "metrics socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/* only a socket left behind by an earlier run is in the way */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+		cyd_fprintf(stderr, LOG_ERROR, "failed to listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* export from a background thread, so the lookup path only does atomic adds */
+int metrics_start(void)
+{
+	metrics.listen_fd = -1;
+
+	if (cfg.metrics_file == NULL && cfg.metrics_socket == NULL)
+		return 0;
+
+	if (cfg.metrics_socket) {
+		metrics.listen_fd = metrics_listen(cfg.metrics_socket);
+		if (metrics.listen_fd < 0)
+			return -1;
+	}
+
+	if (pipe2(metrics.wakeup, O_CLOEXEC) < 0 ||
+			pthread_create(&metrics.thread, NULL, metrics_thread, NULL) != 0) {
+		cyd_fprintf(stderr, LOG_ERROR, "failed to start metrics: %s\n", strerror(errno));
+		return -1;
+	}
+	metrics.running = true;
+
+	return 0;
+}
+
+void metrics_stop(void)
+{
+	if (!metrics.running)
+		return;
+
+	write(metrics.wakeup[1], "", 1);
+	pthread_join(metrics.thread, NULL);
+	metrics.running = false;
+	close(metrics.wakeup[0]);
+	close(metrics.wakeup[1]);
+
+	if (metrics.listen_fd >= 0) {
+		close(metrics.listen_fd);
+		unlink(cfg.metrics_socket);
+	}
+
+	/* leave the final numbers behind */
+	if (cfg.metrics_file)
+		metrics_write_file(cfg.metrics_file);
+}
+
+void *mem_alloc(mem_subsys_t subsys, size_t size)
+{
+	mem_header_t *hdr = malloc(sizeof(mem_header_t) + size);
+
+	if (hdr == NULL)
+		return NULL;
+
+	hdr->size = size;
+	hdr->subsys = subsys;
+	__atomic_fetch_add(&mem_live[subsys], size, __ATOMIC_RELAXED);
+
+	return hdr + 1;
+}
+
+void *mem_calloc(mem_subsys_t subsys, size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ptr = mem_alloc(subsys, nmemb * size);
+
+	return ptr ? memset(ptr, 0, nmemb * size) : NULL;
+}
+
+void mem_free(void *ptr)
+{
+	mem_header_t *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (mem_header_t *)ptr - 1;
+	__atomic_fetch_sub(&mem_live[hdr->subsys], hdr->size, __ATOMIC_RELAXED);
+	free(hdr);
+}
+
+void *mem_realloc(mem_subsys_t subsys, void *ptr, size_t size)
+{
+	mem_header_t *hdr;
+
+	if (ptr == NULL)
+		return mem_alloc(subsys, size);
+
+	hdr = (mem_header_t *)ptr - 1;
+	__atomic_fetch_sub(&mem_live[hdr->subsys], hdr->size, __ATOMIC_RELAXED);
+	hdr = realloc(hdr, sizeof(mem_header_t) + size);
+	if (hdr == NULL) {
+		/* the old block is still there */
+		hdr = (mem_header_t *)ptr - 1;
+		__atomic_fetch_add(&mem_live[hdr->subsys], hdr->size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	hdr->size = size;
+	__atomic_fetch_add(&mem_live[hdr->subsys], size, __ATOMIC_RELAXED);
+
+	return hdr + 1;
+}
+
+char *mem_strdup(mem_subsys_t subsys, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *dup = mem_alloc(subsys, len);
+
+	return dup ? memcpy(dup, str, len) : NULL;
+}
+
+/* hand an allocation over to another subsystem */
+void mem_retag(void *ptr, mem_subsys_t subsys)
+{
+	mem_header_t *hdr = (mem_header_t *)ptr - 1;
+
+	__atomic_fetch_sub(&mem_live[hdr->subsys], hdr->size, __ATOMIC_RELAXED);
+	hdr->subsys = subsys;
+	__atomic_fetch_add(&mem_live[subsys], hdr->size, __ATOMIC_RELAXED);
+}
+
+size_t mem_get_live(mem_subsys_t subsys)
+{
+	return __atomic_load_n(&mem_live[subsys], __ATOMIC_RELAXED);
+}
+
+void mem_report(FILE *stream, loglevel_t level)
+{
+	int i;
+
+	for (i = 0; i < MEM_SUBSYS_MAX; i++)
+		cyd_fprintf(stream, level, "memory: %-12s %zu bytes\n",
+				mem_subsys_names[i], mem_get_live(i));
 }
 
-#define FREE_STRING_LIST(p) do { list_free_inner(p, free); list_free(p); p = NULL; } while(0)
+/* allocators handed to yajl and curl */
+void *yajl_mem_malloc(void *ctx, size_t size)
+{
+	return mem_alloc(MEM_PARSER, size);
+}
+
+void *yajl_mem_realloc(void *ctx, void *ptr, size_t size)
+{
+	return mem_realloc(MEM_PARSER, ptr, size);
+}
+
+void yajl_mem_free(void *ctx, void *ptr)
+{
+	mem_free(ptr);
+}
+
+static yajl_alloc_funcs yajl_mem_funcs = {
+	yajl_mem_malloc,
+	yajl_mem_realloc,
+	yajl_mem_free,
+	NULL,
+};
+
+void *curl_mem_malloc(size_t size)
+{
+	return mem_alloc(MEM_CONNECTION, size);
+}
+
+void *curl_mem_realloc(void *ptr, size_t size)
+{
+	return mem_realloc(MEM_CONNECTION, ptr, size);
+}
+
+char *curl_mem_strdup(const char *str)
+{
+	return mem_strdup(MEM_CONNECTION, str);
+}
+
+void *curl_mem_calloc(size_t nmemb, size_t size)
+{
+	return mem_calloc(MEM_CONNECTION, nmemb, size);
+}
+
+// linked list implemention from libalpm
+list_t *list_add(list_t *list, void *data)
+{
+	list_t *ptr, *lp;
+
+	ptr = malloc(sizeof(list_t));
+	if (ptr == NULL)
+		return list;
+
+	ptr->data = data;
+	ptr->next = NULL;
+
+	/* Special case: the input list is empty */
+	if (list == NULL) {
+		return ptr;
+	}
+
+	lp = list;
+	while (lp->next)
+		lp = lp->next;
+
+	lp->next = ptr;
+	return list;
+}
+
+void list_free(list_t *list)
+{
+	list_t *it = list;
+
+	while (it) {
+		list_t *tmp = it->next;
+		free(it);
+		it = tmp;
+	}
+}
+
+void list_free_inner(list_t *list, list_fn_free fn)
+{
+	list_t *it = list;
+
+	if (fn) {
+		while (it) {
+			if (it->data)
+				fn(it->data);
+			it = it->next;
+		}
+	}
+}
+
+#define FREE_STRING_LIST(p) do { list_free_inner(p, free); list_free(p); p = NULL; } while(0)
+
+void *list_find(const list_t *haystack, const void *needle, list_fn_cmp fn)
+{
+	const list_t *lp = haystack;
+	while (lp) {
+		if (lp->data && fn(lp->data, needle) == 0)
+			return lp->data;
+		lp = lp->next;
+	}
+	return NULL;
+}
+
+char *list_find_str(const list_t *haystack, const char *needle)
+{
+	return (char *)list_find(haystack, (const void *)needle,
+			(list_fn_cmp)strcmp);
+}
+
+int buffer_append(buffer_t *buf, const void *data, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		size_t size = buf->size ? buf->size : 4096;
+		char *newdata;
+
+		while (size < buf->len + len)
+			size *= 2;
+		newdata = mem_realloc(MEM_PARSER, buf->data, size);
+		if (newdata == NULL)
+			return -1;
+		buf->data = newdata;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+
+	return 0;
+}
+
+void buffer_free(buffer_t *buf)
+{
+	mem_free(buf->data);
+	memset(buf, 0, sizeof(buffer_t));
+}
+
+void json_parser_init(json_parser_t *parser)
+{
+	result_t hdr;
+
+	memset(parser, 0, sizeof(json_parser_t));
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RESULT_MAGIC;
+	hdr.version = RESULT_VERSION;
+	buffer_append(&parser->result, &hdr, sizeof(hdr));
+}
+
+void json_parser_free_inner(json_parser_t *parser)
+{
+	if (parser == NULL)
+		return;
+
+	buffer_free(&parser->result);
+	buffer_free(&parser->translation);
+	buffer_free(&parser->explains);
+	buffer_free(&parser->web_values);
+	buffer_free(&parser->web);
+}
+
+/* append an offset array to the result, returns its range */
+result_range_t json_parser_append_array(json_parser_t *parser, const buffer_t *array,
+		size_t elemsize)
+{
+	result_range_t range = { 0, 0 };
+
+	if (array->len == 0)
+		return range;
+
+	range.offset = parser->result.len;
+	range.count = array->len / elemsize;
+	buffer_append(&parser->result, array->data, array->len);
+
+	return range;
+}
+
+/* Lay the collected offset arrays out behind the string table and hand
+ * the buffer over as a result_t, the parser is left empty. */
+result_t *json_parser_finish(json_parser_t *parser)
+{
+	static const char pad[sizeof(uint32_t)];
+	result_range_t translation, explains, web, web_values;
+	result_web_t *dic;
+	result_t *result;
+	size_t i;
+
+	if (parser->result.data == NULL)
+		return NULL;
+
+	if (parser->result.len % sizeof(uint32_t))
+		buffer_append(&parser->result, pad,
+				sizeof(uint32_t) - parser->result.len % sizeof(uint32_t));
+
+	translation = json_parser_append_array(parser, &parser->translation, sizeof(uint32_t));
+	explains = json_parser_append_array(parser, &parser->explains, sizeof(uint32_t));
+	web_values = json_parser_append_array(parser, &parser->web_values, sizeof(uint32_t));
+
+	/* web values were collected as indexes into web_values */
+	dic = (result_web_t *)parser->web.data;
+	for (i = 0; i < parser->web.len / sizeof(result_web_t); i++)
+		dic[i].value.offset = web_values.offset + dic[i].value.offset * sizeof(uint32_t);
+	web = json_parser_append_array(parser, &parser->web, sizeof(result_web_t));
+
+	result = (result_t *)parser->result.data;
+	result->translation = translation;
+	result->explains = explains;
+	result->web = web;
+	result->size = parser->result.len;
+
+	/* the buffer grew in pages, results are kept for a long time */
+	result = mem_realloc(MEM_PARSER, result, result->size) ?: result;
+	mem_retag(result, MEM_RESULT);
+
+	memset(&parser->result, 0, sizeof(buffer_t));
+	json_parser_free_inner(parser);
+
+	return result;
+}
+
+const char *result_str(const result_t *result, uint32_t offset)
+{
+	return offset ? (const char *)result + offset : NULL;
+}
+
+const char *result_strv(const result_t *result, result_range_t range, uint32_t i)
+{
+	const uint32_t *offsets = (const uint32_t *)((const uint8_t *)result + range.offset);
+
+	return result_str(result, offsets[i]);
+}
+
+const result_web_t *result_web(const result_t *result, uint32_t i)
+{
+	return (const result_web_t *)((const uint8_t *)result + result->web.offset) + i;
+}
+
+bool result_check_str(const result_t *result, size_t len, uint32_t offset)
+{
+	if (offset == 0)
+		return true;
+
+	return offset >= sizeof(result_t) && offset < len &&
+		memchr((const char *)result + offset, '\0', len - offset) != NULL;
+}
+
+bool result_check_strv(const result_t *result, size_t len, result_range_t range)
+{
+	uint32_t i;
+
+	if (range.count == 0)
+		return true;
+	if (range.offset % sizeof(uint32_t) ||
+			range.offset < sizeof(result_t) ||
+			(uint64_t)range.offset + (uint64_t)range.count * sizeof(uint32_t) > len)
+		return false;
+
+	for (i = 0; i < range.count; i++) {
+		const uint32_t *offsets = (const uint32_t *)((const uint8_t *)result + range.offset);
+		if (!result_check_str(result, len, offsets[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/* results read from the shared cache come from other processes,
+ * make sure every offset stays inside the buffer before using it */
+bool result_valid(const void *data, size_t len)
+{
+	const result_t *result = data;
+	uint32_t i;
+
+	if (len < sizeof(result_t) || (uintptr_t)data % sizeof(uint32_t))
+		return false;
+	if (result->magic != RESULT_MAGIC || result->version != RESULT_VERSION ||
+			result->size != len)
+		return false;
+
+	if (!result_check_str(result, len, result->query) ||
+			!result_check_str(result, len, result->us_phonetic) ||
+			!result_check_str(result, len, result->phonetic) ||
+			!result_check_str(result, len, result->uk_phonetic) ||
+			!result_check_str(result, len, result->us_speech) ||
+			!result_check_str(result, len, result->speech) ||
+			!result_check_str(result, len, result->uk_speech) ||
+			!result_check_strv(result, len, result->translation) ||
+			!result_check_strv(result, len, result->explains))
+		return false;
+
+	if (result->web.count == 0)
+		return true;
+	if (result->web.offset % sizeof(uint32_t) ||
+			result->web.offset < sizeof(result_t) ||
+			(uint64_t)result->web.offset + (uint64_t)result->web.count * sizeof(result_web_t) > len)
+		return false;
+
+	for (i = 0; i < result->web.count; i++) {
+		const result_web_t *web = result_web(result, i);
+		if (!result_check_str(result, len, web->key) ||
+				!result_check_strv(result, len, web->value))
+			return false;
+	}
+
+	return true;
+}
+
+result_t *result_dup(const result_t *result)
+{
+	result_t *dup = mem_alloc(MEM_RESULT, result->size);
+
+	return dup ? memcpy(dup, result, result->size) : NULL;
+}
+
+int json_end_map(void *ctx)
+{
+	json_parser_t *p = ctx;
+
+	p->depth--;
+	if (p->depth > 0 && p->key) {
+		if (p->key->type == JSON_KEY_WEB_DIC) {
+			buffer_append(&p->web, &p->web_dic, sizeof(result_web_t));
+		}
+	}
+
+	return 1;
+}
+
+void *json_get_valueptr(json_parser_t *parser)
+{
+	uint8_t *addr = 0;
+
+	if (parser->key == NULL)
+		return NULL;
+
+	if (parser->key->multivalued)
+		addr = (uint8_t *)parser;
+	else switch (parser->key->type) {
+		case JSON_KEY_METADATA:
+		case JSON_KEY_BASIC_DIC:
+			addr = (uint8_t *)parser->result.data;
+			break;
+		case JSON_KEY_WEB_DIC:
+			addr = (uint8_t *)&parser->web_dic;
+			break;
+	}
+	cyd_printf(LOG_DEBUG, NC, "json_get_valueptr: type - %d, addr - 0x%x\n",
+			(unsigned int *)parser->key->type, (unsigned int *)addr);
+
+	return addr + parser->key->offset;
+}
+
+int json_integer(void *ctx, long long val)
+{
+	json_parser_t *p = ctx;
+	int32_t *valueptr;
+
+	valueptr = json_get_valueptr(p);
+	if (valueptr == NULL)
+		return 1;
+
+	*valueptr = val;
+
+	return 1;
+}
+
+int json_map_key(void *ctx, const unsigned char *data, size_t size)
+{
+	json_parser_t *p = ctx;
+
+	p->key = string_to_key(data, size);
+
+	return 1;
+}
+
+int json_start_map(void *ctx)
+{
+	json_parser_t *p = ctx;
+
+	p->depth++;
+	cyd_printf(LOG_DEBUG, NC, "json_start_map: depth - %d, json_parser_t - 0x%x\n",
+            p->depth, (unsigned int *)p);
+	if (p->depth > 1) {
+		if (p->key == NULL)
+			return 1;
+		if (p->key->type  == JSON_KEY_BASIC_DIC) {
+			((result_t *)p->result.data)->flags |= RESULT_HAS_BASIC;
+		}
+		else if (p->key->type == JSON_KEY_WEB_DIC) {
+			memset(&p->web_dic, 0, sizeof(result_web_t));
+			p->web_dic.value.offset = p->web_values.len / sizeof(uint32_t);
+		}
+	}
+
+	return 1;
+}
+
+int json_string(void *ctx, const unsigned char *data, size_t size)
+{
+	json_parser_t *p = ctx;
+	uint32_t offset;
+	void *valueptr;
+
+	if (p->key == NULL)
+		return 1;
+
+	/* strings go straight into the string table */
+	offset = p->result.len;
+	if (buffer_append(&p->result, data, size) < 0 ||
+			buffer_append(&p->result, "", 1) < 0)
+		return 0;
+
+	/* the result may have moved */
+	valueptr = json_get_valueptr(p);
+	if (valueptr == NULL)
+		return 1;
+
+	cyd_printf(LOG_DEBUG, NC, "json_string_multivalued: dest - 0x%x, data - %s, size - %d\n",
+			valueptr, data, size);
+	if (p->key->multivalued) {
+		if (p->key->type == JSON_KEY_WEB_DIC)
+			p->web_dic.value.count++;
+		return json_string_multivalued(valueptr, offset);
+	} else
+		return json_string_singlevalued(valueptr, offset);
+}
+
+int json_string_multivalued(buffer_t *dest, uint32_t offset)
+{
+	return buffer_append(dest, &offset, sizeof(offset)) == 0;
+}
+
+int json_string_singlevalued(uint32_t *dest, uint32_t offset)
+{
+	*dest = offset;
+
+	return 1;
+}
+
+int keycmp(const void *v1, const void *v2)
+{
+	const struct key_t *k1 = v1;
+	const struct key_t *k2 = v2;
+
+	return strcmp(k1->name, k2->name);
+}
+
+const struct key_t *string_to_key(const unsigned char *key, size_t len)
+{
+	char keybuf[32];
+	struct key_t k;
+
+	snprintf(keybuf, len + 1, "%s", key);
+
+	k.name = keybuf;
+	return bsearch(&k, json_keys, sizeof(json_keys) / sizeof(json_keys[0]),
+			sizeof(json_keys[0]), keycmp);
+}
+
+int cyd_asprintf(char **string, const char *format, ...)
+{
+	int ret = 0;
+	va_list args;
+
+	va_start(args, format);
+	ret = vasprintf(string, format, args);
+	va_end(args);
+
+	if (ret == -1) {
+		cyd_fprintf(stderr, LOG_ERROR, "failed to allocate string\n");
+	}
+
+	return ret;
+}
+
+#define STORE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+uint64_t store_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	/* 0 marks an empty slot */
+	return h | 1;
+}
+
+/* values are 8 byte aligned, so results can be used from the mapping */
+size_t store_record_size(const store_record_t *rec)
+{
+	return STORE_ALIGN(STORE_ALIGN(sizeof(store_record_t) + rec->keylen + 1) + rec->vallen);
+}
+
+const char *store_record_key(const store_record_t *rec)
+{
+	return (const char *)(rec + 1);
+}
+
+const char *store_record_value(const store_record_t *rec)
+{
+	return (const char *)rec + STORE_ALIGN(sizeof(store_record_t) + rec->keylen + 1);
+}
+
+voidpf store_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return mem_alloc(MEM_CACHE, (size_t)items * size);
+}
+
+void store_zfree(voidpf opaque, voidpf ptr)
+{
+	mem_free(ptr);
+}
+
+/* every record is compressed on its own, so a lookup inflates exactly
+ * one value and the log stays randomly accessible, returns the size of
+ * the compressed value or 0 if it does not pay off. Runs on the lookup
+ * path, so it trades ratio for speed and a ~32KiB zlib state. */
+size_t store_deflate(const char *value, size_t vallen, char **out)
+{
+	z_stream zs = { .zalloc = store_zalloc, .zfree = store_zfree };
+	uint32_t rawlen = vallen;
+	size_t cap;
+	char *buf;
+
+	*out = NULL;
+	if (vallen < STORE_DEFLATE_MIN)
+		return 0;
+
+	if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, -STORE_DEFLATE_WBITS, 5,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+
+	cap = sizeof(rawlen) + deflateBound(&zs, vallen);
+	buf = malloc(cap);
+	if (buf == NULL) {
+		deflateEnd(&zs);
+		return 0;
+	}
+	memcpy(buf, &rawlen, sizeof(rawlen));
+
+	zs.next_in = (Bytef *)value;
+	zs.avail_in = vallen;
+	zs.next_out = (Bytef *)buf + sizeof(rawlen);
+	zs.avail_out = cap - sizeof(rawlen);
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END ||
+			sizeof(rawlen) + zs.total_out >= vallen) {
+		deflateEnd(&zs);
+		free(buf);
+		return 0;
+	}
+	deflateEnd(&zs);
+
+	*out = buf;
+	return sizeof(rawlen) + zs.total_out;
+}
+
+/* whether len bytes at offset are inside the log and backed by the file,
+ * reading the mapping past the end of the file raises SIGBUS */
+bool store_readable(store_t *store, uint64_t offset, uint64_t len)
+{
+	uint64_t end = __atomic_load_n(&store->hdr->log_end, __ATOMIC_ACQUIRE);
+	struct stat st;
+
+	if (offset > end || len > end - offset || end > STORE_MAP_SIZE)
+		return false;
+	if (offset + len <= __atomic_load_n(&store->size, __ATOMIC_RELAXED))
+		return true;
+
+	/* the file grows as records are appended, here or in another process */
+	if (fstat(store->fd, &st) < 0)
+		return false;
+	__atomic_store_n(&store->size, st.st_size, __ATOMIC_RELAXED);
+
+	return offset + len <= (uint64_t)st.st_size;
+}
+
+/* the record at offset, or NULL if it is not a whole record in the file */
+const store_record_t *store_record_at(store_t *store, uint64_t offset)
+{
+	const store_record_t *rec;
+
+	if (offset < store->hdr->log_start ||
+			!store_readable(store, offset, sizeof(store_record_t)))
+		return NULL;
+
+	rec = (const store_record_t *)(store->map + offset);
+	if (rec->magic != STORE_RECORD_MAGIC || !store_readable(store, offset, store_record_size(rec)))
+		return NULL;
+
+	return rec;
+}
+
+/* check the header against the file, a writer in another process may
+ * have reserved log space without writing it yet, so give it a moment */
+bool store_header_valid(store_t *store)
+{
+	const store_header_t *hdr = store->hdr;
+	struct stat st;
+	int retry;
+
+	if (hdr->magic != STORE_MAGIC || hdr->version != STORE_VERSION ||
+			hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+			hdr->log_start < sizeof(*hdr) + (uint64_t)hdr->nslots * sizeof(store_slot_t) ||
+			hdr->log_start > STORE_MAP_SIZE)
+		return false;
+
+	for (retry = 0; retry < 5; retry++) {
+		uint64_t end = __atomic_load_n(&hdr->log_end, __ATOMIC_ACQUIRE);
+
+		if (fstat(store->fd, &st) < 0)
+			return false;
+		store->size = st.st_size;
+
+		if (hdr->log_start <= store->size && end >= hdr->log_start && end <= store->size)
+			return true;
+		usleep(10000);
+	}
+
+	return false;
+}
+
+/* copy the value out of a record, inflating it if needed */
+char *store_record_copy(const store_record_t *rec, mem_subsys_t subsys, size_t *len)
+{
+	z_stream zs = { .zalloc = store_zalloc, .zfree = store_zfree };
+	const char *value = store_record_value(rec);
+	uint32_t rawlen;
+	char *data;
+	int ret;
+
+	if (!(rec->flags & STORE_DEFLATE)) {
+		data = mem_alloc(subsys, rec->vallen);
+		if (data == NULL)
+			return NULL;
+		*len = rec->vallen;
+		return memcpy(data, value, rec->vallen);
+	}
+
+	if (rec->vallen < sizeof(rawlen))
+		return NULL;
+	memcpy(&rawlen, value, sizeof(rawlen));
+
+	data = mem_alloc(subsys, rawlen);
+	if (data == NULL)
+		return NULL;
+
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		mem_free(data);
+		return NULL;
+	}
+	zs.next_in = (Bytef *)value + sizeof(rawlen);
+	zs.avail_in = rec->vallen - sizeof(rawlen);
+	zs.next_out = (Bytef *)data;
+	zs.avail_out = rawlen;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	if (ret != Z_STREAM_END || zs.total_out != rawlen) {
+		mem_free(data);
+		return NULL;
+	}
+
+	*len = rawlen;
+	return data;
+}
+
+/* copy the result out of a record,
+ * returns NULL if the value is not a valid result */
+result_t *store_record_result(const store_record_t *rec)
+{
+	size_t len;
+	char *data = store_record_copy(rec, MEM_RESULT, &len);
+
+	if (data && !result_valid(data, len)) {
+		mem_free(data);
+		return NULL;
+	}
+
+	return (result_t *)data;
+}
+
+/* write an empty store to a temporary file next to path, returns its fd */
+int store_create_tmp(const char *path, uint32_t nslots, char **tmppath)
+{
+	store_header_t hdr;
+	int fd;
+
+	if (cyd_asprintf(tmppath, "%s.XXXXXX", path) == -1)
+		return -1;
+
+	fd = mkostemp(*tmppath, O_CLOEXEC);
+	if (fd < 0) {
+		free(*tmppath);
+		*tmppath = NULL;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = STORE_MAGIC;
+	hdr.version = STORE_VERSION;
+	hdr.nslots = nslots;
+	hdr.log_start = STORE_ALIGN(sizeof(hdr) + (uint64_t)nslots * sizeof(store_slot_t));
+	hdr.log_end = hdr.log_start;
+
+	if (ftruncate(fd, hdr.log_start) < 0 ||
+			pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		close(fd);
+		unlink(*tmppath);
+		free(*tmppath);
+		*tmppath = NULL;
+		return -1;
+	}
+
+	return fd;
+}
+
+void store_close(store_t *store)
+{
+	if (store == NULL)
+		return;
+
+	if (store->map != MAP_FAILED)
+		munmap(store->map, STORE_MAP_SIZE);
+	if (store->fd >= 0)
+		close(store->fd);
+	free(store->path);
+	free(store);
+}
+
+/* open an empty store with nslots next to store, to be renamed over it */
+store_t *store_open_tmp(store_t *store, uint32_t nslots, char **tmppath)
+{
+	store_t *newstore;
+	int fd;
+
+	fd = store_create_tmp(store->path, nslots, tmppath);
+	if (fd < 0)
+		return NULL;
+
+	newstore = calloc(1, sizeof(store_t));
+	if (newstore == NULL) {
+		close(fd);
+		unlink(*tmppath);
+		return NULL;
+	}
+	newstore->fd = fd;
+	newstore->flags = store->flags;
+	newstore->map = mmap(NULL, STORE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	newstore->path = strdup(store->path);
+	if (newstore->map == MAP_FAILED || newstore->path == NULL) {
+		store_close(newstore);
+		unlink(*tmppath);
+		return NULL;
+	}
+	newstore->hdr = (store_header_t *)newstore->map;
+	newstore->slots = (store_slot_t *)(newstore->hdr + 1);
+
+	return newstore;
+}
+
+/* open or create a store, flags say whether an unusable file at path
+ * may be replaced, otherwise it is left alone and NULL returned */
+store_t *store_open(const char *path, int flags)
+{
+	store_t *store;
+	struct stat st;
+	int retry;
+
+	memset(&st, 0, sizeof(st));
+	store = calloc(1, sizeof(store_t));
+	if (store == NULL)
+		return NULL;
+	store->fd = -1;
+	store->map = MAP_FAILED;
+	store->path = strdup(path);
+	store->flags = flags;
+
+	for (retry = 0; retry < 2; retry++) {
+		_cleanup_free_ char *tmppath = NULL;
+		int fd;
+
+		store->fd = open(path, O_RDWR | O_CLOEXEC);
+		if (store->fd >= 0)
+			break;
+		if (errno != ENOENT)
+			goto error;
+
+		/* publish a fully initialized file, losing a race is fine */
+		fd = store_create_tmp(path, STORE_SLOTS, &tmppath);
+		if (fd < 0)
+			goto error;
+		close(fd);
+		if (link(tmppath, path) < 0 && errno != EEXIST) {
+			unlink(tmppath);
+			goto error;
+		}
+		unlink(tmppath);
+	}
+	if (store->fd < 0)
+		goto error;
+
+	if (fstat(store->fd, &st) < 0 || (size_t)st.st_size < sizeof(store_header_t))
+		goto invalid;
+
+	/* reserve the whole address range once, so the mapping never moves */
+	store->map = mmap(NULL, STORE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+	if (store->map == MAP_FAILED)
+		goto error;
+
+	store->hdr = (store_header_t *)store->map;
+	store->slots = (store_slot_t *)(store->hdr + 1);
+
+	if (!store_header_valid(store))
+		goto invalid;
+
+	cyd_printf(LOG_DEBUG, NC, "store_open: %s, slots - %u, live - %lu\n", path,
+			store->hdr->nslots, (unsigned long)store->hdr->live);
+
+	return store;
+
+invalid:
+	/* only start over if the file is ours, never clobber anything else */
+	if (!(flags & STORE_OPEN_OWNED) && (!(flags & STORE_OPEN_RECREATE) ||
+				(size_t)st.st_size < sizeof(store_header_t) ||
+				store->map == MAP_FAILED || store->hdr->magic != STORE_MAGIC)) {
+		cyd_fprintf(stderr, LOG_ERROR, "%s is not a usable cydcv store, not overwriting it\n",
+				path);
+		store_close(store);
+		return NULL;
+	}
+
+	cyd_printf(LOG_DEBUG, NC, "store_open: recreating %s\n", path);
+	{
+		_cleanup_free_ char *tmppath = NULL;
+		int fd = store_create_tmp(path, STORE_SLOTS, &tmppath);
+
+		if (fd >= 0) {
+			close(fd);
+			if (rename(tmppath, path) < 0)
+				unlink(tmppath);
+			else {
+				store_close(store);
+				return store_open(path, flags);
+			}
+		}
+	}
+error:
+	cyd_fprintf(stderr, LOG_WARN, "failed to open cache %s: %s\n", path, strerror(errno));
+	store_close(store);
+	return NULL;
+}
+
+/* open an existing store for lookups only, used for offline indexes */
+store_t *store_open_readonly(const char *path)
+{
+	store_t *store;
+	struct stat st;
+
+	store = calloc(1, sizeof(store_t));
+	if (store == NULL)
+		return NULL;
+	store->map = MAP_FAILED;
+	store->path = strdup(path);
+	store->flags = STORE_OPEN_READONLY;
+
+	store->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (store->fd < 0 || fstat(store->fd, &st) < 0)
+		goto error;
+
+	errno = EINVAL;
+	if ((size_t)st.st_size < sizeof(store_header_t))
+		goto error;
+
+	store->map = mmap(NULL, STORE_MAP_SIZE, PROT_READ, MAP_SHARED, store->fd, 0);
+	if (store->map == MAP_FAILED)
+		goto error;
+
+	store->hdr = (store_header_t *)store->map;
+	store->slots = (store_slot_t *)(store->hdr + 1);
+
+	errno = EINVAL;
+	if (!store_header_valid(store))
+		goto error;
+
+	return store;
+
+error:
+	cyd_fprintf(stderr, LOG_ERROR, "failed to open index %s: %s\n", path, strerror(errno));
+	store_close(store);
+	return NULL;
+}
+
+/* lock-free lookup, the returned record lives in the mapping */
+const store_record_t *store_get(store_t *store, const char *key)
+{
+	size_t keylen = strlen(key);
+	uint64_t hash = store_hash(key, keylen);
+	uint32_t mask = store->hdr->nslots - 1;
+	uint32_t i;
+
+	for (i = 0; i <= mask; i++) {
+		store_slot_t *slot = &store->slots[(hash + i) & mask];
+		uint64_t slothash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+		const store_record_t *rec;
+		uint64_t offset;
+
+		if (slothash == 0)
+			return NULL;
+		if (slothash != hash)
+			continue;
+
+		offset = __atomic_load_n(&slot->offset, __ATOMIC_ACQUIRE);
+		rec = store_record_at(store, offset);
+		if (rec == NULL || rec->hash != hash)
+			return NULL;
+		if (rec->keylen != keylen || memcmp(store_record_key(rec), key, keylen) != 0)
+			return NULL;
+		if ((uint32_t)store_hash(store_record_value(rec), rec->vallen) != rec->checksum)
+			return NULL;
+
+		return rec;
+	}
+
+	return NULL;
+}
+
+/* append a record at offset and point its slot at it */
+int store_publish(store_t *store, const store_record_t *rec, uint64_t offset)
+{
+	uint32_t mask = store->hdr->nslots - 1;
+	uint32_t i;
+
+	for (i = 0; i <= mask; i++) {
+		store_slot_t *slot = &store->slots[(rec->hash + i) & mask];
+		uint64_t slothash = 0;
+		uint64_t old;
+
+		if (!__atomic_compare_exchange_n(&slot->hash, &slothash, rec->hash, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && slothash != rec->hash)
+			continue;
+
+		old = __atomic_exchange_n(&slot->offset, offset, __ATOMIC_ACQ_REL);
+		if (old == 0) {
+			__atomic_fetch_add(&store->hdr->live, 1, __ATOMIC_RELAXED);
+		} else {
+			const store_record_t *oldrec = store_record_at(store, old);
+
+			if (oldrec)
+				__atomic_fetch_add(&store->hdr->dead_bytes, store_record_size(oldrec),
+						__ATOMIC_RELAXED);
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+/* append a record, the value is stored as is. Callers that want it
+ * compressed pass the output of store_deflate() with STORE_DEFLATE set. */
+int store_put(store_t *store, const char *key, const char *value, size_t vallen,
+		time_t fetched, int errorcode, uint32_t flags)
+{
+	_cleanup_free_ store_record_t *rec = NULL;
+	size_t keylen = strlen(key);
+	size_t reclen;
+	uint64_t offset;
+
+	reclen = STORE_ALIGN(STORE_ALIGN(sizeof(store_record_t) + keylen + 1) + vallen);
+	rec = calloc(1, reclen);
+	if (rec == NULL)
+		return -1;
+
+	rec->magic = STORE_RECORD_MAGIC;
+	rec->flags = flags;
+	rec->keylen = keylen;
+	rec->vallen = vallen;
+	rec->fetched = fetched;
+	rec->errorcode = errorcode;
+	rec->hash = store_hash(key, keylen);
+	memcpy((char *)store_record_key(rec), key, keylen);
+	memcpy((char *)store_record_value(rec), value, vallen);
+	rec->checksum = store_hash(value, vallen);
+
+	offset = __atomic_fetch_add(&store->hdr->log_end, reclen, __ATOMIC_ACQ_REL);
+	if (offset + reclen > STORE_MAP_SIZE)
+		return -1;
+
+	if (pwrite(store->fd, rec, reclen, offset) != (ssize_t)reclen)
+		return -1;
+
+	return store_publish(store, rec, offset);
+}
+
+/* whether the slot table is full enough for probing to get slow */
+bool store_filling(store_t *store)
+{
+	return __atomic_load_n(&store->hdr->live, __ATOMIC_RELAXED) > store->hdr->nslots / 4 * 3;
+}
+
+bool store_needs_compaction(store_t *store)
+{
+	store_header_t *hdr = store->hdr;
+	uint64_t used = __atomic_load_n(&hdr->log_end, __ATOMIC_ACQUIRE) - hdr->log_start;
+	uint64_t dead = __atomic_load_n(&hdr->dead_bytes, __ATOMIC_RELAXED);
+
+	return (used > STORE_COMPACT_MIN && dead > used / 2) ||
+		store_filling(store) ||
+		used > STORE_MAP_SIZE / 4 * 3;
+}
+
+/* Rewrite live records into a new file and rename it over the old one,
+ * returns the new store or NULL if there was nothing done. Only
+ * compactors take the file lock, readers and writers never wait, and
+ * the old store stays usable until store_retire() is called on it.
+ * Writes that land in the old file after it was copied are lost unless
+ * store_catch_up() picks them up, which is acceptable for a cache. */
+store_t *store_compact(store_t *store, time_t now)
+{
+	store_t *newstore;
+	_cleanup_free_ char *tmppath = NULL;
+	uint32_t nslots = STORE_SLOTS, i;
+	uint64_t live = __atomic_load_n(&store->hdr->live, __ATOMIC_RELAXED);
+	uint64_t offset;
+
+	if (flock(store->fd, LOCK_EX | LOCK_NB) < 0)
+		return NULL;
+	if (__atomic_load_n(&store->hdr->retired, __ATOMIC_ACQUIRE))
+		goto done;
+
+	while (nslots < live * 2)
+		nslots <<= 1;
+
+	newstore = store_open_tmp(store, nslots, &tmppath);
+	if (newstore == NULL)
+		goto done;
+
+	newstore->copied = __atomic_load_n(&store->hdr->log_end, __ATOMIC_ACQUIRE);
+	offset = newstore->hdr->log_start;
+	for (i = 0; i < store->hdr->nslots; i++) {
+		uint64_t old = __atomic_load_n(&store->slots[i].offset, __ATOMIC_ACQUIRE);
+		const store_record_t *rec;
+		size_t reclen;
+
+		if (old == 0)
+			continue;
+
+		rec = store_record_at(store, old);
+		if (rec == NULL)
+			continue;
+		/* expired negative entries would be refetched anyway */
+		if ((rec->flags & STORE_NEGATIVE) && now - rec->fetched >= CACHE_NEGATIVE_TTL)
+			continue;
+
+		reclen = store_record_size(rec);
+		if (pwrite(newstore->fd, rec, reclen, offset) != (ssize_t)reclen ||
+				store_publish(newstore, rec, offset) < 0)
+			break;
+		offset += reclen;
+	}
+	newstore->hdr->log_end = offset;
+
+	if (i < store->hdr->nslots || rename(tmppath, store->path) < 0) {
+		store_close(newstore);
+		unlink(tmppath);
+		goto done;
+	}
+
+	cyd_printf(LOG_DEBUG, NC, "store_compact: %s, slots - %u, live - %lu\n",
+			store->path, nslots, (unsigned long)newstore->hdr->live);
+
+	return newstore;
+
+done:
+	flock(store->fd, LOCK_UN);
+	return NULL;
+}
+
+/* copy what was appended to store while it was being compacted into
+ * newstore, in log order so the newest record for a key wins. Writers
+ * of this process must be stopped, those of others are still lost.
+ * Returns -1 if it stopped short of the end of the log. */
+int store_catch_up(store_t *store, store_t *newstore)
+{
+	uint64_t offset = newstore->copied;
+	uint64_t end = __atomic_load_n(&store->hdr->log_end, __ATOMIC_ACQUIRE);
+
+	while (offset < end) {
+		const store_record_t *rec = store_record_at(store, offset);
+		uint64_t to;
+		size_t reclen;
+
+		/* space reserved by a writer that has not written it yet */
+		if (rec == NULL)
+			return -1;
+
+		reclen = store_record_size(rec);
+		to = __atomic_fetch_add(&newstore->hdr->log_end, reclen, __ATOMIC_ACQ_REL);
+		if (to + reclen > STORE_MAP_SIZE ||
+				pwrite(newstore->fd, rec, reclen, to) != (ssize_t)reclen ||
+				store_publish(newstore, rec, to) < 0)
+			return -1;
+		offset += reclen;
+		newstore->copied = offset;
+	}
+
+	return 0;
+}
+
+/* tell everyone using a compacted store to reopen its path */
+void store_retire(store_t *store)
+{
+	__atomic_store_n(&store->hdr->retired, 1, __ATOMIC_RELEASE);
+	flock(store->fd, LOCK_UN);
+}
+
+/* Move a store whose slot table is filling up into a file with twice the
+ * slots. Unlike store_compact() the whole log is copied, records that
+ * were written over included. Writers of this process must be stopped,
+ * those of others have to check store_retired() after each put and put
+ * again if it is. Returns the new store and closes the old one, or NULL
+ * leaving it as it was. */
+store_t *store_grow(store_t *store)
+{
+	store_t *newstore;
+	_cleanup_free_ char *tmppath = NULL;
+	int tries;
+
+	if (flock(store->fd, LOCK_EX | LOCK_NB) < 0)
+		return NULL;
+
+	newstore = store_open_tmp(store, store->hdr->nslots * 2, &tmppath);
+	if (newstore == NULL)
+		goto fail;
+
+	newstore->copied = store->hdr->log_start;
+	if (store_catch_up(store, newstore) < 0 || rename(tmppath, store->path) < 0) {
+		store_close(newstore);
+		unlink(tmppath);
+		goto fail;
+	}
+
+	cyd_printf(LOG_DEBUG, NC, "store_grow: %s, slots - %u, live - %lu\n",
+			store->path, newstore->hdr->nslots, (unsigned long)newstore->hdr->live);
+
+	/* copy what others appended before they could see it was retired,
+	 * waiting a little for space reserved but not written yet */
+	store_retire(store);
+	for (tries = 0; tries < 5 && store_catch_up(store, newstore) < 0; tries++)
+		usleep(1000);
+	store_close(store);
+	return newstore;
+
+fail:
+	flock(store->fd, LOCK_UN);
+	return NULL;
+}
+
+bool store_retired(store_t *store)
+{
+	return __atomic_load_n(&store->hdr->retired, __ATOMIC_ACQUIRE);
+}
+
+/* pick up a store that another process compacted away */
+void store_refresh(store_t **storep)
+{
+	store_t *store = *storep;
+
+	if (store == NULL || !store_retired(store))
+		return;
+
+	if (store->flags & STORE_OPEN_READONLY)
+		*storep = store_open_readonly(store->path);
+	else
+		*storep = store_open(store->path, store->flags);
+	store_close(store);
+}
+
+/* store_refresh for a store shared by threads that hold lock for reading
+ * while they use it, returns with lock held for reading again */
+void store_refresh_shared(store_t **storep, pthread_rwlock_t *lock)
+{
+	while (*storep && store_retired(*storep)) {
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_wrlock(lock);
+		store_refresh(storep);
+		pthread_rwlock_unlock(lock);
+		pthread_rwlock_rdlock(lock);
+	}
+}
+
+char *store_default_path(void)
+{
+	_cleanup_free_ char *dir = NULL;
+	const char *base = getenv("XDG_CACHE_HOME");
+	char *path = NULL;
+
+	if (base && *base)
+		dir = strdup(base);
+	else if (getenv("HOME"))
+		cyd_asprintf(&dir, "%s/.cache", getenv("HOME"));
+	if (dir == NULL)
+		return NULL;
+
+	mkdir(dir, 0700);
+	if (cyd_asprintf(&path, "%s/cydcv", dir) == -1)
+		return NULL;
+	mkdir(path, 0700);
+	free(path);
+
+	if (cyd_asprintf(&path, "%s/cydcv/cache", dir) == -1)
+		return NULL;
+
+	return path;
+}
+
+void pool_queue_init(pool_queue_t *q)
+{
+	size_t i;
+
+	for (i = 0; i < POOL_QUEUE_SIZE; i++)
+		q->cells[i].seq = i;
+	q->enqueue_pos = 0;
+	q->dequeue_pos = 0;
+}
+
+bool pool_queue_push(pool_queue_t *q, const task_t *task)
+{
+	size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	pool_cell_t *cell;
+
+	while (1) {
+		size_t seq;
+
+		cell = &q->cells[pos & (POOL_QUEUE_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((intptr_t)(seq - pos) < 0) {
+			/* full */
+			return false;
+		} else
+			pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	}
+
+	cell->task = *task;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+bool pool_queue_pop(pool_queue_t *q, task_t *task)
+{
+	size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	pool_cell_t *cell;
+
+	while (1) {
+		size_t seq;
+
+		cell = &q->cells[pos & (POOL_QUEUE_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((intptr_t)(seq - (pos + 1)) < 0) {
+			/* empty */
+			return false;
+		} else
+			pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	}
+
+	*task = cell->task;
+	__atomic_store_n(&cell->seq, pos + POOL_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/* take a task from our own queue first, then steal from the others */
+bool pool_take(task_t *task)
+{
+	size_t start = pool_self >= 0 ? (size_t)pool_self : 0;
+	size_t i;
+
+	for (i = 0; i < pool.nworkers; i++) {
+		if (pool_queue_pop(&pool.queues[(start + i) % pool.nworkers], task)) {
+			__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void *pool_worker(void *arg)
+{
+	task_t task;
+	bool stop;
+
+	pool_self = (intptr_t)arg;
+
+	while (1) {
+		if (pool_take(&task)) {
+			task.run(task.arg);
+			continue;
+		}
+
+		/* pairs with the pending/sleepers check in pool_submit, one of
+		 * the two sides always sees the other */
+		pthread_mutex_lock(&pool.lock);
+		__atomic_add_fetch(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) <= 0 && !pool.stop)
+			pthread_cond_wait(&pool.wakeup, &pool.lock);
+		__atomic_sub_fetch(&pool.sleepers, 1, __ATOMIC_SEQ_CST);
+		stop = pool.stop && __atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) <= 0;
+		pthread_mutex_unlock(&pool.lock);
+
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+/* run fn(arg) on a worker, or right here if there is no pool or it is full */
+void pool_submit(void (*fn)(void *arg), void *arg)
+{
+	task_t task = { fn, arg };
+	size_t i, start;
+
+	if (pool.nworkers == 0) {
+		fn(arg);
+		return;
+	}
+
+	start = pool_self >= 0 ? (size_t)pool_self :
+		__atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < pool.nworkers; i++)
+		if (pool_queue_push(&pool.queues[(start + i) % pool.nworkers], &task))
+			break;
+
+	if (i == pool.nworkers) {
+		fn(arg);
+		return;
+	}
+
+	__atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool.sleepers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool.lock);
+		pthread_cond_signal(&pool.wakeup);
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+/* run one queued task on the calling thread, returns false if there was none */
+bool pool_help(void)
+{
+	task_t task;
+
+	if (pool.nworkers == 0 || !pool_take(&task))
+		return false;
+
+	task.run(task.arg);
+	return true;
+}
+
+int pool_init(int nworkers)
+{
+	intptr_t i;
+
+	if (nworkers <= 1)
+		return 0;
+
+	pool.queues = aligned_alloc(64, nworkers * sizeof(pool_queue_t));
+	pool.threads = calloc(nworkers, sizeof(pthread_t));
+	if (pool.queues == NULL || pool.threads == NULL) {
+		free(pool.queues);
+		free(pool.threads);
+		return -1;
+	}
+
+	for (i = 0; i < nworkers; i++)
+		pool_queue_init(&pool.queues[i]);
+	pool.nworkers = nworkers;
+
+	/* the queue of a worker that failed to start is drained by stealing */
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&pool.threads[i], NULL, pool_worker, (void *)i) != 0)
+			break;
+		pool.nthreads++;
+	}
+	if (pool.nthreads == 0) {
+		pool.nworkers = 0;
+		free(pool.queues);
+		free(pool.threads);
+		return -1;
+	}
+	cyd_printf(LOG_DEBUG, NC, "pool_init: %zu workers\n", pool.nthreads);
+
+	return 0;
+}
+
+/* let the workers finish what is queued and join them */
+void pool_free(void)
+{
+	size_t i;
+
+	if (pool.nworkers == 0)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.wakeup);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.nthreads; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	free(pool.queues);
+	free(pool.threads);
+	pool.queues = NULL;
+	pool.threads = NULL;
+	pool.nworkers = 0;
+	pool.nthreads = 0;
+}
+
+void latch_init(latch_t *latch)
+{
+	pthread_mutex_init(&latch->lock, NULL);
+	pthread_cond_init(&latch->cond, NULL);
+	latch->remaining = 0;
+}
+
+void latch_destroy(latch_t *latch)
+{
+	pthread_mutex_destroy(&latch->lock);
+	pthread_cond_destroy(&latch->cond);
+}
+
+void latch_add(latch_t *latch)
+{
+	pthread_mutex_lock(&latch->lock);
+	latch->remaining++;
+	pthread_mutex_unlock(&latch->lock);
+}
+
+/* one task is finished, flag marks which one if the waiter cares */
+void latch_done(latch_t *latch, bool *flag)
+{
+	pthread_mutex_lock(&latch->lock);
+	if (flag)
+		*flag = true;
+	latch->remaining--;
+	pthread_cond_broadcast(&latch->cond);
+	pthread_mutex_unlock(&latch->lock);
+}
+
+/* wait for flag, or for all tasks if it is NULL, helping the workers
+ * with queued tasks in the meantime */
+void latch_wait(latch_t *latch, bool *flag)
+{
+	while (1) {
+		bool finished;
+
+		pthread_mutex_lock(&latch->lock);
+		finished = flag ? *flag : latch->remaining == 0;
+		pthread_mutex_unlock(&latch->lock);
+
+		if (finished || !pool_help())
+			break;
+	}
+
+	pthread_mutex_lock(&latch->lock);
+	while (flag ? !*flag : latch->remaining > 0)
+		pthread_cond_wait(&latch->cond, &latch->lock);
+	pthread_mutex_unlock(&latch->lock);
+}
+
+size_t yajl_parse_stream(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	transfer_t *t = stream;
+	size_t realsize = size * nmemb;
+	uint64_t start = now_usec();
+
+	yajl_parse(t->hand, ptr, realsize);
+	t->parsing += now_usec() - start;
+
+	if (t->recording && buffer_append(&t->body, ptr, realsize) < 0)
+		t->recording = false;
+
+	return realsize;
+}
+
+/* keep the body for a worker, the I/O loop only copies bytes */
+size_t transfer_buffer_stream(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	transfer_t *t = stream;
+	size_t realsize = size * nmemb;
+
+	if (buffer_append(&t->body, ptr, realsize) < 0)
+		return 0;
+
+	return realsize;
+}
+
+void transfer_free(transfer_t *t)
+{
+	if (t->started)
+		__atomic_fetch_sub(&metrics.inflight, 1, __ATOMIC_RELAXED);
+	if (t->hand)
+		yajl_free(t->hand);
+	json_parser_free_inner(&t->parser);
+	buffer_free(&t->body);
+	free(t->url);
+	free(t->word);
+	memset(t, 0, sizeof(transfer_t));
+}
+
+/* point curl at the API for word and stream the response into the parser,
+ * or into t->body if buffered */
+int transfer_init(transfer_t *t, CURL *curl, const char *word, bool buffered)
+{
+	_cleanup_curl_free_ char *escaped = NULL;
+
+	memset(t, 0, sizeof(transfer_t));
+	t->curl = curl;
+	t->buffered = buffered;
+	t->recording = cfg.record != NULL;
+	if (t->recording) {
+		t->word = strdup(word);
+		if (t->word == NULL)
+			return -1;
+	}
+
+	if (buffered) {
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, transfer_buffer_stream);
+	} else {
+		json_parser_init(&t->parser);
+
+		t->hand = yajl_alloc(&callbacks, &yajl_mem_funcs, &t->parser);
+		if (t->hand == NULL) {
+			transfer_free(t);
+			return -1;
+		}
+
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, yajl_parse_stream);
+	}
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, t);
+	/* decoded by curl as it streams in, before yajl sees it */
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip, deflate");
+
+	escaped = curl_easy_escape(curl, word, strlen(word));
+	if (escaped) {
+		cyd_printf(LOG_DEBUG, NC, "Encoded: %s\n", escaped);
+	}
+
+	if (cyd_asprintf(&t->url, YD_API_URL, API, API_KEY, API_VERSION, escaped) == -1) {
+		transfer_free(t);
+		return -1;
+	}
+	curl_easy_setopt(curl, CURLOPT_URL, t->url);
+
+	t->started = now_usec();
+	__atomic_fetch_add(&metrics.inflight, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* check how the transfer went, failures are logged and counted */
+bool transfer_ok(transfer_t *t, CURLcode curlstat)
+{
+	long httpcode;
+
+	histogram_since(METRIC_FETCH, t->started);
+
+	if (curlstat != CURLE_OK) {
+		cyd_fprintf(stderr, LOG_ERROR, "%s\n", curl_easy_strerror(curlstat));
+		metrics_inc(METRIC_FETCH_ERRORS);
+		return false;
+	}
+
+	curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &httpcode);
+	cyd_printf(LOG_DEBUG, NC, "server responded with %ld\n", httpcode);
+	if (httpcode >= 400) {
+		cyd_fprintf(stderr, LOG_ERROR, "error, server responded with HTTP %ld\n", httpcode);
+		metrics_inc(METRIC_FETCH_ERRORS);
+		return false;
+	}
+
+	return true;
+}
+
+/* append a response to the corpus as is, compressing it would hold up
+ * the I/O thread. The index is doubled before it fills up so that no
+ * response is dropped. */
+int corpus_put(const char *word, const char *value, size_t len, time_t recorded,
+		long httpcode)
+{
+	store_t *grown;
+	bool filling;
+	int ret;
+
+	/* another process recording to the same file may grow it, a put
+	 * that landed in the old file as it was retired is made again */
+	pthread_rwlock_rdlock(&corpus_lock);
+	do {
+		store_refresh_shared(&corpus, &corpus_lock);
+		if (corpus == NULL) {
+			pthread_rwlock_unlock(&corpus_lock);
+			return -1;
+		}
+		ret = store_put(corpus, word, value, len, recorded, httpcode, 0);
+	} while (ret == 0 && store_retired(corpus));
+	filling = store_filling(corpus);
+	pthread_rwlock_unlock(&corpus_lock);
+
+	if (ret == 0 && !filling)
+		return 0;
+
+	pthread_rwlock_wrlock(&corpus_lock);
+	store_refresh(&corpus);
+	if (corpus == NULL) {
+		pthread_rwlock_unlock(&corpus_lock);
+		return -1;
+	}
+	/* another recorder may have grown it in the meantime */
+	if (store_filling(corpus)) {
+		grown = store_grow(corpus);
+		/* or another process is growing it right now */
+		if (grown)
+			corpus = grown;
+		else
+			cyd_printf(LOG_DEBUG, NC, "corpus_put: could not grow %s\n", cfg.record);
+	}
+	if (ret < 0)
+		ret = store_put(corpus, word, value, len, recorded, httpcode, 0);
+	pthread_rwlock_unlock(&corpus_lock);
+
+	return ret;
+}
+
+/* append the response to the corpus, one pwrite and a shared lock */
+void transfer_record(transfer_t *t, CURLcode curlstat)
+{
+	_cleanup_free_ char *value = NULL;
+	corpus_entry_t entry;
+	long httpcode = 0;
+
+	if (!t->recording || curlstat != CURLE_OK)
+		return;
+
+	curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &httpcode);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.recorded = time(NULL);
+	entry.httpcode = httpcode;
+	entry.bodylen = t->body.len;
+	entry.total = now_usec() - t->started;
+	entry.parsing = t->parsing;
+
+	value = malloc(sizeof(entry) + t->body.len);
+	if (value == NULL)
+		return;
+	memcpy(value, &entry, sizeof(entry));
+	if (t->body.len)
+		memcpy(value + sizeof(entry), t->body.data, t->body.len);
+
+	if (corpus_put(t->word, value, sizeof(entry) + t->body.len, entry.recorded, httpcode) < 0)
+		cyd_fprintf(stderr, LOG_WARN, "failed to record %s, it is missing from %s\n",
+				t->word, cfg.record);
+}
+
+/* take the result of a streamed transfer, t is freed either way */
+result_t *transfer_finish(transfer_t *t, CURLcode curlstat)
+{
+	result_t *result = NULL;
+	uint64_t start;
+
+	transfer_record(t, curlstat);
+	if (transfer_ok(t, curlstat)) {
+		start = now_usec();
+		yajl_complete_parse(t->hand);
+
+		result = json_parser_finish(&t->parser);
+		histogram_observe(METRIC_PARSE, t->parsing + now_usec() - start);
+	}
+
+	transfer_free(t);
+	return result;
+}
+
+/* parse a complete response that is already in memory */
+result_t *parse_response(const char *data, size_t len)
+{
+	struct yajl_handle_t *hand;
+	json_parser_t parser;
+	result_t *result;
+	uint64_t start = now_usec();
+
+	json_parser_init(&parser);
+
+	hand = yajl_alloc(&callbacks, &yajl_mem_funcs, &parser);
+	if (hand == NULL) {
+		json_parser_free_inner(&parser);
+		return NULL;
+	}
+
+	yajl_parse(hand, (const unsigned char *)data, len);
+	yajl_complete_parse(hand);
+	yajl_free(hand);
+
+	result = json_parser_finish(&parser);
+	json_parser_free_inner(&parser);
+	histogram_since(METRIC_PARSE, start);
+
+	return result;
+}
+
+void parse_task(void *arg)
+{
+	parse_job_t *job = arg;
+
+	*job->result = parse_response(job->body.data, job->body.len);
+	buffer_free(&job->body);
+	latch_done(job->latch, NULL);
+}
+
+result_t *fetch(CURL *curl, const char *word)
+{
+	transfer_t t;
+
+	if (transfer_init(&t, curl, word, false) < 0)
+		return NULL;
+
+	cyd_printf(LOG_DEBUG, NC, "curl_easy_perform %s\n", t.url);
+
+	return transfer_finish(&t, curl_easy_perform(curl));
+}
+
+/* fetch all words at once, results[i] is NULL for failed lookups,
+ * with a pool the bodies are parsed by workers while this thread
+ * keeps driving the transfers */
+void fetch_many(const char **words, size_t n, result_t **results)
+{
+	transfer_t *transfers;
+	parse_job_t *jobs = NULL;
+	size_t next = 0, active = 0;
+	bool buffered = pool.nworkers > 0;
+	size_t parallel = n <= FETCH_MAX_BURST ? n : FETCH_MAX_PARALLEL;
+	latch_t latch;
+	CURLM *multi;
+
+	memset(results, 0, n * sizeof(result_t *));
+	latch_init(&latch);
+
+	multi = curl_multi_init();
+	transfers = calloc(n, sizeof(transfer_t));
+	if (buffered)
+		jobs = calloc(n, sizeof(parse_job_t));
+	if (multi == NULL || transfers == NULL || (buffered && jobs == NULL))
+		goto done;
+
+	while (next < n || active > 0) {
+		CURLMsg *msg;
+		int running, queued;
+
+		while (next < n && active < parallel) {
+			CURL *curl = curl_easy_init();
+
+			if (curl == NULL || transfer_init(&transfers[next], curl, words[next], buffered) < 0) {
+				if (curl)
+					curl_easy_cleanup(curl);
+			} else if (curl_multi_add_handle(multi, curl) != 0) {
+				transfer_free(&transfers[next]);
+				curl_easy_cleanup(curl);
+			} else {
+				cyd_printf(LOG_DEBUG, NC, "fetch_many: %s\n", transfers[next].url);
+				active++;
+			}
+			next++;
+		}
+
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &queued))) {
+			CURL *curl = msg->easy_handle;
+			CURLcode curlstat = msg->data.result;
+			transfer_t *t;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&t);
+			curl_multi_remove_handle(multi, curl);
+			if (!t->buffered) {
+				results[t - transfers] = transfer_finish(t, curlstat);
+			} else {
+				transfer_record(t, curlstat);
+				if (transfer_ok(t, curlstat)) {
+					parse_job_t *job = &jobs[t - transfers];
+
+					job->body = t->body;
+					memset(&t->body, 0, sizeof(buffer_t));
+					job->result = &results[t - transfers];
+					job->latch = &latch;
+					latch_add(&latch);
+					pool_submit(parse_task, job);
+				}
+				transfer_free(t);
+			}
+			curl_easy_cleanup(curl);
+			active--;
+		}
+
+		if (active > 0)
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+	}
+
+done:
+	latch_wait(&latch, NULL);
+	latch_destroy(&latch);
+	free(jobs);
+	free(transfers);
+	if (multi)
+		curl_multi_cleanup(multi);
+}
+
+/* an empty or failed result is only kept for CACHE_NEGATIVE_TTL */
+bool result_is_negative(const result_t *result)
+{
+	return result->errorcode != 0 ||
+		(!(result->flags & RESULT_HAS_BASIC) && result->translation.count == 0 &&
+		 result->web.count == 0);
+}
+
+bool result_is_good(const result_t *result)
+{
+	return result && !result_is_negative(result);
+}
+
+void backend_record(backend_t *backend, uint64_t start, bool failed)
+{
+	uint64_t sample = now_usec() - start;
+	uint64_t latency = __atomic_load_n(&backend->latency, __ATOMIC_RELAXED);
+
+	/* exponentially weighted, 1/8 per sample */
+	latency = latency ? latency - latency / 8 + sample / 8 : sample;
+	__atomic_store_n(&backend->latency, latency, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&backend->requests, 1, __ATOMIC_RELAXED);
+	if (failed)
+		__atomic_fetch_add(&backend->failures, 1, __ATOMIC_RELAXED);
+
+	cyd_printf(LOG_DEBUG, NC, "backend %s: sample - %luus, latency - %luus\n",
+			backend->name, (unsigned long)sample, (unsigned long)latency);
+}
+
+result_t *backend_lookup(backend_t *backend, CURL *curl, const char *word)
+{
+	uint64_t start = now_usec();
+	result_t *result;
+
+	result = backend->lookup(backend, curl, word);
+	backend_record(backend, start, result == NULL && !backend->local);
+
+	return result;
+}
+
+result_t *youdao_lookup(backend_t *backend, CURL *curl, const char *word)
+{
+	return fetch(curl, word);
+}
+
+void youdao_lookup_many(backend_t *backend, const char **words, size_t n,
+		result_t **results)
+{
+	fetch_many(words, n, results);
+}
+
+result_t *index_lookup(backend_t *backend, CURL *curl, const char *word)
+{
+	const store_record_t *rec = store_get(backend->data, word);
+
+	if (rec == NULL)
+		return NULL;
+
+	return store_record_result(rec);
+}
+
+void index_free(backend_t *backend)
+{
+	store_close(backend->data);
+}
+
+/* answer from a recorded response, failed requests fail again */
+result_t *replay_lookup(backend_t *backend, CURL *curl, const char *word)
+{
+	const store_record_t *rec;
+	const corpus_entry_t *entry;
+	result_t *result = NULL;
+	const char *value;
+	char *copy = NULL;
+	size_t len;
+
+	/* the corpus may still be recorded to and grown by another process */
+	pthread_rwlock_rdlock(&backend->lock);
+	store_refresh_shared((store_t **)&backend->data, &backend->lock);
+	if (backend->data == NULL)
+		goto done;
+
+	rec = store_get(backend->data, word);
+	if (rec == NULL)
+		goto done;
+
+	/* uncompressed values are parsed straight from the mapping */
+	if (rec->flags & STORE_DEFLATE) {
+		copy = store_record_copy(rec, MEM_PARSER, &len);
+		if (copy == NULL)
+			goto done;
+		value = copy;
+	} else {
+		value = store_record_value(rec);
+		len = rec->vallen;
+	}
+
+	entry = (const corpus_entry_t *)value;
+	if (len < sizeof(corpus_entry_t) || sizeof(corpus_entry_t) + entry->bodylen > len)
+		goto done;
+
+	cyd_printf(LOG_DEBUG, NC, "replay: %s, HTTP %d, recorded in %lu us\n", word,
+			entry->httpcode, (unsigned long)entry->total);
+	if (entry->httpcode < 400)
+		result = parse_response(value + sizeof(corpus_entry_t), entry->bodylen);
+
+done:
+	pthread_rwlock_unlock(&backend->lock);
+	mem_free(copy);
+	return result;
+}
+
+void replay_free(backend_t *backend)
+{
+	store_close(backend->data);
+	pthread_rwlock_destroy(&backend->lock);
+}
+
+/* append str as a JSON string */
+void json_quote(buffer_t *buf, const char *str)
+{
+	buffer_append(buf, "\"", 1);
+	for (; *str; str++) {
+		char esc[8];
+
+		if (*str == '"' || *str == '\\') {
+			esc[0] = '\\';
+			esc[1] = *str;
+			buffer_append(buf, esc, 2);
+		} else if ((unsigned char)*str < 0x20) {
+			snprintf(esc, sizeof(esc), "\\u%04x", *str);
+			buffer_append(buf, esc, 6);
+		} else
+			buffer_append(buf, str, 1);
+	}
+	buffer_append(buf, "\"", 1);
+}
+
+/* answers every word with a canned response, after an optional delay */
+result_t *mock_lookup(backend_t *backend, CURL *curl, const char *word)
+{
+	buffer_t body = { NULL, 0, 0 };
+	result_t *result;
+	uint64_t call = __atomic_fetch_add(&backend->calls, 1, __ATOMIC_RELAXED);
+
+	if (backend->delay > 0)
+		usleep(backend->delay * 1000);
+
+#define APPEND(s) buffer_append(&body, s, strlen(s))
+	/* fail in turn like a dropped connection, an HTTP error page and an
+	 * API error */
+	if (backend->fail_every > 0 && call % backend->fail_every == 0) {
+		switch (call / backend->fail_every % 3) {
+			case 0:
+				return NULL;
+			case 1:
+				APPEND("<html><body>502 Bad Gateway</body></html>");
+				break;
+			case 2:
+				APPEND("{\"errorcode\":50,\"query\":");
+				json_quote(&body, word);
+				APPEND("}");
+				break;
+		}
+		result = parse_response(body.data, body.len);
+		buffer_free(&body);
+		return result;
+	}
+
+	APPEND("{\"translation\":[");
+	json_quote(&body, word);
+	APPEND("],\"basic\":{\"phonetic\":\"mɒk\",\"explains\":[");
+	json_quote(&body, word);
+	APPEND("]},\"query\":");
+	json_quote(&body, word);
+	APPEND(",\"errorcode\":0,\"web\":[{\"value\":[");
+	json_quote(&body, word);
+	APPEND("],\"key\":");
+	json_quote(&body, word);
+	APPEND("}]}");
+#undef APPEND
+
+	result = parse_response(body.data, body.len);
+	buffer_free(&body);
+
+	return result;
+}
+
+/* build a backend from "name" or "name:argument" */
+backend_t *backend_new(const char *spec)
+{
+	_cleanup_free_ char *name = strdup(spec);
+	backend_t *backend;
+	char *arg;
+
+	if (name == NULL)
+		return NULL;
+
+	arg = strchr(name, ':');
+	if (arg)
+		*arg++ = '\0';
+
+	backend = calloc(1, sizeof(backend_t));
+	if (backend == NULL)
+		return NULL;
+	backend->spec = strdup(spec);
+	if (backend->spec == NULL)
+		goto error;
+
+	if (streq(name, "youdao")) {
+		backend->name = "youdao";
+		backend->lookup = youdao_lookup;
+		backend->lookup_many = youdao_lookup_many;
+	} else if (streq(name, "index") && arg && *arg) {
+		backend->name = "index";
+		backend->local = true;
+		backend->lookup = index_lookup;
+		backend->free = index_free;
+		backend->data = store_open_readonly(arg);
+		if (backend->data == NULL)
+			goto error;
+	} else if (streq(name, "replay") && arg && *arg) {
+		backend->name = "replay";
+		backend->local = true;
+		backend->lookup = replay_lookup;
+		backend->free = replay_free;
+		backend->data = store_open_readonly(arg);
+		if (backend->data == NULL)
+			goto error;
+		pthread_rwlock_init(&backend->lock, NULL);
+	} else if (streq(name, "mock")) {
+		backend->name = "mock";
+		backend->local = true;
+		backend->lookup = mock_lookup;
+		backend->delay = arg ? atol(arg) : 0;
+		if (arg && strchr(arg, ':'))
+			backend->fail_every = atol(strchr(arg, ':') + 1);
+	} else {
+		cyd_fprintf(stderr, LOG_ERROR, "unknown backend: %s\n", spec);
+		goto error;
+	}
+
+	return backend;
+
+error:
+	free(backend->spec);
+	free(backend);
+	return NULL;
+}
+
+void backend_free(void *data)
+{
+	backend_t *backend = data;
+
+	if (backend->free)
+		backend->free(backend);
+	free(backend->spec);
+	free(backend);
+}
+
+/* comma separated backend specs */
+int router_init(const char *specs)
+{
+	_cleanup_free_ char *copy = strdup(specs);
+	char *spec, *saveptr = NULL;
+
+	if (copy == NULL)
+		return -1;
+
+	for (spec = strtok_r(copy, ",", &saveptr); spec; spec = strtok_r(NULL, ",", &saveptr)) {
+		backend_t *backend = backend_new(spec);
+
+		if (backend == NULL)
+			return -1;
+		router.backends = list_add(router.backends, backend);
+	}
+
+	return router.backends ? 0 : -1;
+}
+
+/* wait for fanned out lookups that lost the race */
+void router_drain(void)
+{
+	pthread_mutex_lock(&router.lock);
+	while (router.inflight > 0)
+		pthread_cond_wait(&router.idle, &router.lock);
+	pthread_mutex_unlock(&router.lock);
+}
+
+void router_free(void)
+{
+	router_drain();
+	list_free_inner(router.backends, backend_free);
+	list_free(router.backends);
+	router.backends = NULL;
+}
+
+int backend_latency_cmp(const void *v1, const void *v2)
+{
+	const backend_t *b1 = *(backend_t * const *)v1, *b2 = *(backend_t * const *)v2;
+	uint64_t l1 = __atomic_load_n(&b1->latency, __ATOMIC_RELAXED);
+	uint64_t l2 = __atomic_load_n(&b2->latency, __ATOMIC_RELAXED);
+
+	if (b1->pinned != b2->pinned)
+		return b2->pinned - b1->pinned;
+
+	return (l1 > l2) - (l1 < l2);
+}
+
+/* backends ordered by their latency so far, untried ones first, behind
+ * the pinned ones */
+backend_t **router_candidates(size_t *n)
+{
+	backend_t **backends;
+	list_t *it;
+
+	*n = 0;
+	for (it = router.backends; it; it = it->next)
+		(*n)++;
+
+	backends = calloc(*n, sizeof(backend_t *));
+	if (backends == NULL)
+		return NULL;
+
+	*n = 0;
+	for (it = router.backends; it; it = it->next)
+		backends[(*n)++] = it->data;
+	qsort(backends, *n, sizeof(backend_t *), backend_latency_cmp);
+
+	return backends;
+}
+
+/* keep the better of two results, frees the other one */
+void router_merge(result_t **best, backend_t **best_source,
+		result_t *result, backend_t *source)
+{
+	if (result == NULL)
+		return;
+
+	if (*best == NULL || (result_is_good(result) && !result_is_good(*best))) {
+		mem_free(*best);
+		*best = result;
+		*best_source = source;
+	} else
+		mem_free(result);
+}
+
+void fanout_put(fanout_t *fanout)
+{
+	if (--fanout->refs > 0) {
+		pthread_mutex_unlock(&fanout->lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&fanout->lock);
+	pthread_mutex_destroy(&fanout->lock);
+	pthread_cond_destroy(&fanout->done);
+	mem_free(fanout->winner);
+	mem_free(fanout->fallback);
+	free(fanout->word);
+	free(fanout);
+}
+
+void *fanout_thread(void *arg)
+{
+	fanout_job_t *job = arg;
+	fanout_t *fanout = job->fanout;
+	backend_t *backend = job->backend;
+	result_t *result;
+	CURL *curl = NULL;
+
+	free(job);
+
+	if (!backend->local)
+		curl = curl_easy_init();
+	result = (backend->local || curl) ? backend_lookup(backend, curl, fanout->word) : NULL;
+	if (curl)
+		curl_easy_cleanup(curl);
+
+	pthread_mutex_lock(&fanout->lock);
+	if (fanout->closed)
+		mem_free(result);
+	else if (result_is_good(result) && fanout->winner == NULL) {
+		fanout->winner = result;
+		fanout->winner_source = backend;
+	} else
+		router_merge(&fanout->fallback, &fanout->fallback_source, result, backend);
+	fanout->pending--;
+	pthread_cond_broadcast(&fanout->done);
+	fanout_put(fanout);
+
+	pthread_mutex_lock(&router.lock);
+	router.inflight--;
+	pthread_cond_broadcast(&router.idle);
+	pthread_mutex_unlock(&router.lock);
+
+	return NULL;
+}
+
+/* ask every backend at once and take the first good answer */
+result_t *router_fanout(backend_t **backends, size_t n, const char *word,
+		backend_t **source)
+{
+	fanout_t *fanout;
+	result_t *result;
+	size_t i;
+
+	fanout = calloc(1, sizeof(fanout_t));
+	if (fanout == NULL)
+		return NULL;
+	pthread_mutex_init(&fanout->lock, NULL);
+	pthread_cond_init(&fanout->done, NULL);
+	fanout->word = strdup(word);
+	fanout->refs = 1;
+
+	pthread_mutex_lock(&fanout->lock);
+	for (i = 0; i < n && fanout->word; i++) {
+		fanout_job_t *job = malloc(sizeof(fanout_job_t));
+		pthread_attr_t attr;
+		pthread_t thread;
+
+		if (job == NULL)
+			break;
+		job->fanout = fanout;
+		job->backend = backends[i];
+
+		pthread_mutex_lock(&router.lock);
+		router.inflight++;
+		pthread_mutex_unlock(&router.lock);
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, fanout_thread, job) == 0) {
+			fanout->pending++;
+			fanout->refs++;
+		} else {
+			free(job);
+			pthread_mutex_lock(&router.lock);
+			router.inflight--;
+			pthread_mutex_unlock(&router.lock);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	while (fanout->winner == NULL && fanout->pending > 0)
+		pthread_cond_wait(&fanout->done, &fanout->lock);
+
+	if (fanout->winner) {
+		result = fanout->winner;
+		*source = fanout->winner_source;
+		fanout->winner = NULL;
+	} else {
+		result = fanout->fallback;
+		*source = fanout->fallback_source;
+		fanout->fallback = NULL;
+	}
+	fanout->closed = true;
+	fanout_put(fanout);
+
+	return result;
+}
+
+/* Look word up in the configured backends. With ROUTE_FASTEST they are
+ * tried one after another, historically fastest first, until one has a
+ * good answer. Pinned backends are always tried first and on their own,
+ * with either route. *source is set to the backend the result came from. */
+result_t *router_lookup(CURL *curl, const char *word, backend_t **source)
+{
+	_cleanup_free_ backend_t **backends = NULL;
+	backend_t *fanned = NULL;
+	result_t *best = NULL;
+	size_t n, i;
+
+	*source = NULL;
+
+	backends = router_candidates(&n);
+	if (backends == NULL)
+		return NULL;
+
+	for (i = 0; i < n && backends[i]->pinned && !result_is_good(best); i++) {
+		if (i > 0)
+			metrics_inc(METRIC_RETRIES);
+		router_merge(&best, source, backend_lookup(backends[i], curl, word), backends[i]);
+	}
+
+	if (!result_is_good(best) && cfg.route == ROUTE_FANOUT && n - i > 1) {
+		if (i > 0)
+			metrics_inc(METRIC_RETRIES);
+		router_merge(&best, source, router_fanout(backends + i, n - i, word, &fanned), fanned);
+		return best;
+	}
+
+	for (; i < n && !result_is_good(best); i++) {
+		if (i > 0)
+			metrics_inc(METRIC_RETRIES);
+		router_merge(&best, source, backend_lookup(backends[i], curl, word), backends[i]);
+	}
+
+	return best;
+}
+
+/* batched router_lookup, each backend gets all words still missing. Always
+ * walks the backends fastest first, --route fanout only applies to single
+ * lookups: firing a whole batch at every backend would multiply the
+ * requests by the number of backends to save one fallback round trip. */
+void router_lookup_many(const char **words, size_t n, result_t **results,
+		backend_t **sources)
+{
+	_cleanup_free_ backend_t **backends = NULL;
+	_cleanup_free_ const char **missing = NULL;
+	_cleanup_free_ result_t **found = NULL;
+	_cleanup_free_ size_t *index = NULL;
+	size_t nbackends, b, i;
+
+	memset(results, 0, n * sizeof(result_t *));
+	memset(sources, 0, n * sizeof(backend_t *));
+
+	backends = router_candidates(&nbackends);
+	missing = calloc(n, sizeof(char *));
+	found = calloc(n, sizeof(result_t *));
+	index = calloc(n, sizeof(size_t));
+	if (backends == NULL || missing == NULL || found == NULL || index == NULL)
+		return;
+
+	for (b = 0; b < nbackends; b++) {
+		backend_t *backend = backends[b];
+		size_t nmissing = 0;
+
+		for (i = 0; i < n; i++) {
+			if (result_is_good(results[i]))
+				continue;
+			missing[nmissing] = words[i];
+			index[nmissing++] = i;
+		}
+		if (nmissing == 0)
+			break;
+		if (b > 0)
+			__atomic_fetch_add(&metrics.counters[METRIC_RETRIES], nmissing, __ATOMIC_RELAXED);
+
+		if (backend->lookup_many) {
+			uint64_t start = now_usec();
+
+			backend->lookup_many(backend, missing, nmissing, found);
+			backend_record(backend, start, false);
+		} else {
+			CURL *curl = backend->local ? NULL : curl_easy_init();
+
+			for (i = 0; i < nmissing; i++)
+				found[i] = (backend->local || curl) ?
+					backend_lookup(backend, curl, missing[i]) : NULL;
+			if (curl)
+				curl_easy_cleanup(curl);
+		}
+
+		for (i = 0; i < nmissing; i++)
+			router_merge(&results[index[i]], &sources[index[i]], found[i], backend);
+	}
+}
+
+void cache_entry_free(void *data)
+{
+	cache_entry_t *entry = data;
+
+	mem_free(entry->result);
+	mem_free(entry->word);
+	mem_free(entry);
+}
+
+cache_entry_t **cache_bucket(const char *word)
+{
+	return &cache.buckets[store_hash(word, strlen(word)) & (CACHE_BUCKETS - 1)];
+}
+
+void cache_unlink(cache_entry_t *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache.head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+void cache_push_front(cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache.head;
+	if (cache.head)
+		cache.head->prev = entry;
+	else
+		cache.tail = entry;
+	cache.head = entry;
+}
+
+/* find the entry for word and move it to the front,
+ * must be called with cache.lock held */
+cache_entry_t *cache_find(const char *word)
+{
+	cache_entry_t *entry;
+
+	for (entry = *cache_bucket(word); entry; entry = entry->chain) {
+		if (!streq(entry->word, word))
+			continue;
+
+		if (entry != cache.head) {
+			cache_unlink(entry);
+			cache_push_front(entry);
+		}
+		return entry;
+	}
+
+	return NULL;
+}
+
+/* drop least recently used entries, they are still in the shared cache,
+ * must be called with cache.lock held */
+void cache_evict(void)
+{
+	while (cache.count > CACHE_MAX_ENTRIES && cache.tail != cache.head) {
+		cache_entry_t *entry = cache.tail, **it;
+
+		cyd_printf(LOG_DEBUG, NC, "cache_evict: %s\n", entry->word);
+		for (it = cache_bucket(entry->word); *it != entry; it = &(*it)->chain)
+			;
+		*it = entry->chain;
+		cache_unlink(entry);
+		cache_entry_free(entry);
+		cache.count--;
+	}
+}
+
+void cache_clear(void)
+{
+	pthread_mutex_lock(&cache.lock);
+	while (cache.head) {
+		cache_entry_t *entry = cache.head;
+
+		cache_unlink(entry);
+		cache_entry_free(entry);
+	}
+	memset(cache.buckets, 0, sizeof(cache.buckets));
+	cache.count = 0;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+bool cache_entry_expired(const cache_entry_t *entry, time_t now)
+{
+	time_t ttl = entry->negative ? CACHE_NEGATIVE_TTL : CACHE_TTL;
+
+	return now - entry->fetched >= ttl;
+}
+
+/* replace the result of an entry, which takes ownership of result */
+void cache_entry_set(cache_entry_t *entry, result_t *result, time_t fetched)
+{
+	mem_free(entry->result);
+	mem_retag(result, MEM_CACHE);
+
+	entry->result = result;
+	entry->fetched = fetched;
+	entry->errorcode = result->errorcode;
+	entry->negative = result_is_negative(result);
+}
+
+/* must be called with cache.lock held */
+cache_entry_t *cache_store(const char *word, result_t *result, time_t fetched)
+{
+	cache_entry_t *entry;
+
+	entry = cache_find(word);
+	if (entry == NULL) {
+		cache_entry_t **bucket = cache_bucket(word);
+
+		entry = mem_calloc(MEM_CACHE, 1, sizeof(cache_entry_t));
+		if (entry)
+			entry->word = mem_strdup(MEM_CACHE, word);
+		if (entry == NULL || entry->word == NULL) {
+			if (entry)
+				mem_free(entry->word);
+			mem_free(entry);
+			return NULL;
+		}
+
+		entry->chain = *bucket;
+		*bucket = entry;
+		cache_push_front(entry);
+		cache.count++;
+		cache_evict();
+	}
+
+	cache_entry_set(entry, result, fetched);
+	cyd_printf(LOG_DEBUG, NC, "cache_store: %s, errorcode - %d, negative - %d\n",
+			word, entry->errorcode, entry->negative);
+
+	return entry;
+}
 
-void *list_find(const list_t *haystack, const void *needle, list_fn_cmp fn)
+/* Compact the shared cache without holding cache.lock, lookups keep
+ * using the old store meanwhile. It can not be swapped out from under
+ * us, cache_reopen leaves it alone while we run even if another process
+ * retires it before we get its file lock. */
+void *cache_compact_thread(void *arg)
 {
-	const list_t *lp = haystack;
-	while (lp) {
-		if (lp->data && fn(lp->data, needle) == 0)
-			return lp->data;
-		lp = lp->next;
+	store_t *store = arg, *newstore;
+
+	newstore = store_compact(store, time(NULL));
+
+	pthread_mutex_lock(&cache.lock);
+	if (newstore) {
+		store_catch_up(store, newstore);
+		store_retire(store);
+		store_close(store);
+		cache.store = newstore;
 	}
+	cache.compacting = false;
+	pthread_cond_broadcast(&cache.idle);
+	pthread_mutex_unlock(&cache.lock);
+
 	return NULL;
 }
 
-char *list_find_str(const list_t *haystack, const char *needle)
+/* start a compaction at most every CACHE_COMPACT_INTERVAL,
+ * must be called with cache.lock held */
+void cache_compact(time_t now)
 {
-	return (char *)list_find(haystack, (const void *)needle,
-			(list_fn_cmp)strcmp);
-}
+	pthread_t thread;
+	pthread_attr_t attr;
 
-void free_basic_dic(basic_dic_t *basic_dic)
-{
-	if (basic_dic == NULL)
+	if (cache.compacting || now - cache.compacted < CACHE_COMPACT_INTERVAL)
 		return;
+	cache.compacted = now;
 
-	free(basic_dic->us_phonetic);
-	free(basic_dic->phonetic);
-	free(basic_dic->uk_phonetic);
-	free(basic_dic->us_speech);
-	free(basic_dic->speech);
-	free(basic_dic->uk_speech);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, cache_compact_thread, cache.store) == 0)
+		cache.compacting = true;
+	pthread_attr_destroy(&attr);
+}
+
+/* pick up a shared cache another process compacted away, unless our own
+ * compactor still has it, must be called with cache.lock held */
+void cache_reopen(void)
+{
+	if (!cache.compacting)
+		store_refresh(&cache.store);
+}
 
-	FREE_STRING_LIST(basic_dic->explains);
+/* compress a result for cache_persist(), done before taking cache.lock
+ * so other lookups do not wait on zlib. Returns 0 if it is to be stored
+ * as is. */
+size_t cache_pack(const result_t *result, const backend_t *source, char **packed)
+{
+	*packed = NULL;
+	if (source->local || cfg.cache_file == NULL)
+		return 0;
 
-	memset(basic_dic, 0, sizeof(basic_dic_t));
+	return store_deflate((const char *)result, result->size, packed);
 }
 
-void free_web_dic_inner(void *web_dic)
+/* write a result through to the shared cache, packed by cache_pack(),
+ * must be called with cache.lock held */
+void cache_persist(const char *word, const result_t *result, time_t fetched,
+		const char *packed, size_t packedlen)
 {
-	if (web_dic == NULL)
+	const char *value = (const char *)result;
+	size_t vallen = result->size;
+	uint32_t flags = result_is_negative(result) ? STORE_NEGATIVE : 0;
+
+	cache_reopen();
+	if (cache.store == NULL)
 		return;
 
-	web_dic_t *dic = (web_dic_t *)web_dic;
+	if (packedlen > 0) {
+		value = packed;
+		vallen = packedlen;
+		flags |= STORE_DEFLATE;
+	}
 
-	free(dic->key);
-	FREE_STRING_LIST(dic->value);
+	if (store_put(cache.store, word, value, vallen, fetched, result->errorcode, flags) < 0)
+		cyd_printf(LOG_DEBUG, NC, "cache_persist: failed to store %s\n", word);
 
-	memset(dic, 0, sizeof(web_dic_t));
+	if (store_needs_compaction(cache.store))
+		cache_compact(fetched);
 }
 
-void free_web_dic(void *web_dic)
+/* promote an entry from the shared cache if it is newer than what we have,
+ * must be called with cache.lock held */
+cache_entry_t *cache_load(const char *word, time_t newer_than)
 {
-	free_web_dic_inner(web_dic);
-	free(web_dic);
+	const store_record_t *rec;
+	result_t *result;
+
+	cache_reopen();
+	if (cache.store == NULL)
+		return NULL;
+
+	rec = store_get(cache.store, word);
+	if (rec == NULL || rec->fetched <= newer_than)
+		return NULL;
+
+	result = store_record_result(rec);
+	if (result == NULL)
+		return NULL;
+
+	cyd_printf(LOG_DEBUG, NC, "cache_load: %s, fetched - %ld\n", word, (long)rec->fetched);
+
+	return cache_store(word, result, rec->fetched);
 }
 
-#define FREE_WEB_DIC_LIST(p) do { list_free_inner(p, free_web_dic); list_free(p); p = NULL; } while(0)
+void *cache_refresh_thread(void *arg)
+{
+	_cleanup_free_ char *word = arg;
+	_cleanup_free_ char *packed = NULL;
+	result_t *result = NULL;
+	backend_t *source = NULL;
+	cache_entry_t *entry;
+	size_t packedlen = 0;
+	time_t now;
+	CURL *curl;
+
+	/* easy handles can not be shared between threads */
+	curl = curl_easy_init();
+	if (curl) {
+		result = router_lookup(curl, word, &source);
+		curl_easy_cleanup(curl);
+	}
+	if (result)
+		packedlen = cache_pack(result, source, &packed);
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache.lock);
+	entry = cache_find(word);
+	if (entry)
+		entry->refreshing = false;
+
+	/* keep serving the stale result if the refresh failed or came back
+	 * empty, a negative answer only replaces one that was negative too */
+	if (result && !result_is_good(result) && !(entry && entry->negative)) {
+		cyd_printf(LOG_DEBUG, NC, "cache_refresh: keeping stale %s\n", word);
+		mem_free(result);
+		result = NULL;
+	}
 
-void json_parser_free_inner(json_parser_t *parser)
+	if (result && !source->local)
+		cache_persist(word, result, now, packed, packedlen);
+	if (entry && result) {
+		cache_entry_set(entry, result, now);
+		result = NULL;
+	}
+	cache.refreshing--;
+	pthread_cond_broadcast(&cache.idle);
+	pthread_mutex_unlock(&cache.lock);
+
+	mem_free(result);
+
+	return NULL;
+}
+
+/* must be called with cache.lock held */
+void cache_refresh(cache_entry_t *entry)
 {
-	if (parser == NULL)
+	pthread_t thread;
+	pthread_attr_t attr;
+	char *word;
+
+	if (entry->refreshing)
 		return;
 
-	/* free allocated string fields */
-	free(parser->query);
+	word = strdup(entry->word);
+	if (word == NULL)
+		return;
+
+	cyd_printf(LOG_DEBUG, NC, "cache_refresh: %s\n", word);
+	metrics_inc(METRIC_CACHE_REFRESHES);
 
-	/* free extended list info */
-	FREE_STRING_LIST(parser->translation);
-	free_basic_dic(parser->basic_dic);
-	free(parser->basic_dic);
-	FREE_WEB_DIC_LIST(parser->web_dic_list);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, cache_refresh_thread, word) == 0) {
+		entry->refreshing = true;
+		cache.refreshing++;
+	} else
+		free(word);
+	pthread_attr_destroy(&attr);
 }
 
-void json_parser_free(json_parser_t *parser)
+/* wait for background refreshes and compaction before tearing down
+ * curl and the store */
+void cache_drain(void)
 {
-	json_parser_free_inner(parser);
-	free(parser);
+	pthread_mutex_lock(&cache.lock);
+	while (cache.refreshing > 0 || cache.compacting)
+		pthread_cond_wait(&cache.idle, &cache.lock);
+	pthread_mutex_unlock(&cache.lock);
 }
 
-web_dic_t *webdic_dup(web_dic_t *web_dic)
+/* returns a copy of the cached result for word, or NULL if it has to be
+ * fetched. Stale results are returned while a refresh runs behind them. */
+result_t *cache_lookup(const char *word, time_t now)
 {
-	web_dic_t *new_dic;
+	cache_entry_t *entry;
+	result_t *result = NULL;
+
+	pthread_mutex_lock(&cache.lock);
+	entry = cache_find(word);
+	/* another process may have fetched it more recently */
+	if (entry == NULL || cache_entry_expired(entry, now)) {
+		cache_entry_t *loaded = cache_load(word, entry ? entry->fetched : 0);
+		if (loaded)
+			entry = loaded;
+	}
+	if (entry) {
+		bool expired = cache_entry_expired(entry, now);
+
+		/* stale-while-revalidate: serve what we have, refresh behind it.
+		 * expired negative entries are simply refetched */
+		if (!expired || !entry->negative) {
+			cyd_printf(LOG_DEBUG, NC, "cache hit: %s, expired - %d\n", word, expired);
+			if (expired)
+				cache_refresh(entry);
+			result = result_dup(entry->result);
+			metrics_inc(expired ? METRIC_CACHE_STALE_HITS : METRIC_CACHE_HITS);
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
 
-	new_dic = malloc(sizeof(web_dic_t));
+	if (result == NULL)
+		metrics_inc(METRIC_CACHE_MISSES);
 
-	return new_dic ? memcpy(new_dic, web_dic, sizeof(web_dic_t)) : NULL;
+	return result;
 }
 
+/* add a result to the cache, which takes ownership of it. Results from
+ * remote backends are written through to the shared cache as well. */
+void cache_insert(const char *word, result_t *result, const backend_t *source, time_t now)
+{
+	_cleanup_free_ char *packed = NULL;
+	size_t packedlen = cache_pack(result, source, &packed);
+
+	pthread_mutex_lock(&cache.lock);
+	if (!source->local)
+		cache_persist(word, result, now, packed, packedlen);
+	if (cache_store(word, result, now) == NULL)
+		mem_free(result);
+	pthread_mutex_unlock(&cache.lock);
+}
 
-int json_end_map(void *ctx)
+/* look up all words, going to the backends once for every miss */
+void lookup_many(const char **words, size_t n, result_t **results)
 {
-	json_parser_t *p = ctx;
+	_cleanup_free_ const char **missing = NULL;
+	_cleanup_free_ result_t **fetched = NULL;
+	_cleanup_free_ backend_t **sources = NULL;
+	_cleanup_free_ size_t *index = NULL;
+	time_t now = time(NULL);
+	size_t i, nmissing = 0;
+
+	missing = calloc(n, sizeof(char *));
+	fetched = calloc(n, sizeof(result_t *));
+	sources = calloc(n, sizeof(backend_t *));
+	index = calloc(n, sizeof(size_t));
+	if (missing == NULL || fetched == NULL || sources == NULL || index == NULL) {
+		memset(results, 0, n * sizeof(result_t *));
+		return;
+	}
 
-	p->depth--;
-	if (p->depth > 0) {
-		if (p->key->type == JSON_KEY_WEB_DIC) {
-			p->web_dic_list = list_add(p->web_dic_list, webdic_dup(&p->web_dic));
+	for (i = 0; i < n; i++) {
+		results[i] = cache_lookup(words[i], now);
+		if (results[i] == NULL) {
+			missing[nmissing] = words[i];
+			index[nmissing++] = i;
 		}
 	}
 
-	return 1;
+	if (nmissing == 0)
+		return;
+
+	router_lookup_many(missing, nmissing, fetched, sources);
+
+	for (i = 0; i < nmissing; i++) {
+		result_t *dup;
+
+		if (fetched[i] == NULL)
+			continue;
+		results[index[i]] = fetched[i];
+		dup = result_dup(fetched[i]);
+		if (dup)
+			cache_insert(missing[i], dup, sources[i], now);
+	}
 }
 
-void *json_get_valueptr(json_parser_t *parser)
+int query(CURL *curl, const char *word)
 {
-	uint8_t *addr = 0;
-
-	if (parser->key == NULL)
-		return NULL;
+	result_t *result;
+	backend_t *source;
+	time_t now = time(NULL);
+
+	result = cache_lookup(word, now);
+	if (result) {
+		print_explanation(result);
+		mem_free(result);
+		return 0;
+	}
 
-	switch (parser->key->type) {
-		case JSON_KEY_METADATA:
-			addr = (uint8_t *)parser;
-			break;
-		case JSON_KEY_BASIC_DIC:
-			addr = (uint8_t *)parser->basic_dic;
-			break;
-		case JSON_KEY_WEB_DIC:
-			addr = (uint8_t *)&parser->web_dic;
-			break;
+	result = router_lookup(curl, word, &source);
+	if (result == NULL) {
+		cyd_fprintf(stderr, LOG_ERROR, "no result from any backend for %s\n", word);
+		return -1;
 	}
-	cyd_printf(LOG_DEBUG, NC, "json_get_valueptr: type - %d, addr - 0x%x\n",
-			(unsigned int *)parser->key->type, (unsigned int *)addr);
 
-	return addr + parser->key->offset;
+	print_explanation(result);
+	cache_insert(word, result, source, now);
+
+	return 0;
 }
 
-int json_integer(void *ctx, long long val)
+/* decode one UTF-8 sequence, invalid input is consumed a byte at a time */
+size_t utf8_decode(const char *str, size_t len, uint32_t *cp)
 {
-	json_parser_t *p = ctx;
-	int *valueptr;
+	const uint8_t *s = (const uint8_t *)str;
+	size_t n, i;
 
-	valueptr = json_get_valueptr(p);
-	if (valueptr == NULL)
+	if (s[0] < 0x80) {
+		*cp = s[0];
 		return 1;
+	} else if ((s[0] & 0xe0) == 0xc0) {
+		*cp = s[0] & 0x1f;
+		n = 2;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		*cp = s[0] & 0x0f;
+		n = 3;
+	} else if ((s[0] & 0xf8) == 0xf0) {
+		*cp = s[0] & 0x07;
+		n = 4;
+	} else
+		goto invalid;
+
+	if (n > len)
+		goto invalid;
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			goto invalid;
+		*cp = (*cp << 6) | (s[i] & 0x3f);
+	}
 
-	*valueptr = val;
+	return n;
 
+invalid:
+	*cp = 0xfffd;
 	return 1;
 }
 
-int json_map_key(void *ctx, const unsigned char *data, size_t size)
+/* ideographs and kana are looked up one character at a time */
+bool codepoint_is_cjk(uint32_t cp)
 {
-	json_parser_t *p = ctx;
+	return (cp >= 0x3040 && cp <= 0x30ff) ||
+		(cp >= 0x3400 && cp <= 0x4dbf) ||
+		(cp >= 0x4e00 && cp <= 0x9fff) ||
+		(cp >= 0xf900 && cp <= 0xfaff) ||
+		(cp >= 0x20000 && cp <= 0x2fa1f);
+}
 
-	p->key = string_to_key(data, size);
+bool codepoint_is_word(uint32_t cp)
+{
+	if (cp < 0x80)
+		return (cp >= '0' && cp <= '9') || (cp >= 'a' && cp <= 'z') ||
+			(cp >= 'A' && cp <= 'Z');
+
+	/* punctuation blocks separate words */
+	return !(cp <= 0xbf ||
+			(cp >= 0x2000 && cp <= 0x2bff) ||
+			(cp >= 0x3000 && cp <= 0x303f) ||
+			(cp >= 0xfe30 && cp <= 0xfe4f) ||
+			(cp >= 0xff00 && cp <= 0xff0f) ||
+			(cp >= 0xff1a && cp <= 0xff20) ||
+			(cp >= 0xff3b && cp <= 0xff40) ||
+			(cp >= 0xff5b && cp <= 0xff65) ||
+			cp == 0xfffd || codepoint_is_cjk(cp));
+}
+
+/* terminal columns taken by a code point */
+int codepoint_width(uint32_t cp)
+{
+	if (cp >= 0x0300 && cp <= 0x036f)
+		return 0;
+
+	if ((cp >= 0x1100 && cp <= 0x115f) ||
+			(cp >= 0x2e80 && cp <= 0xa4cf && cp != 0x303f) ||
+			(cp >= 0xac00 && cp <= 0xd7a3) ||
+			(cp >= 0xf900 && cp <= 0xfaff) ||
+			(cp >= 0xfe30 && cp <= 0xfe4f) ||
+			(cp >= 0xff00 && cp <= 0xff60) ||
+			(cp >= 0xffe0 && cp <= 0xffe6) ||
+			(cp >= 0x20000 && cp <= 0x3fffd))
+		return 2;
 
 	return 1;
 }
 
-int json_start_map(void *ctx)
+/* width of str in columns, stopping before max columns are exceeded,
+ * *len is set to the number of bytes that fit */
+int utf8_width(const char *str, size_t *len, int max)
 {
-	json_parser_t *p = ctx;
+	size_t i = 0;
+	int width = 0;
 
-	p->depth++;
-	cyd_printf(LOG_DEBUG, NC, "json_start_map: depth - %d, json_parser_t - 0x%x\n",
-            p->depth, (unsigned int *)p);
-	if (p->depth > 1) {
-		if (p->key->type  == JSON_KEY_BASIC_DIC) {
-			p->basic_dic = malloc(sizeof(basic_dic_t));
-			memset(p->basic_dic, 0, sizeof(basic_dic_t));
-		}
-		else if (p->key->type == JSON_KEY_WEB_DIC) {
-			// p->web_dic = malloc(sizeof(web_dic_t));
-			memset(&p->web_dic, 0, sizeof(web_dic_t));
-		}
+	while (i < *len) {
+		uint32_t cp;
+		size_t n = utf8_decode(str + i, *len - i, &cp);
+		int w = codepoint_width(cp);
+
+		if (max >= 0 && width + w > max)
+			break;
+		width += w;
+		i += n;
 	}
+	*len = i;
 
-	return 1;
+	return width;
 }
 
-int json_string(void *ctx, const unsigned char *data, size_t size)
+/* Split a sentence into Latin words and single CJK characters. Each
+ * token refers to one of the deduplicated, lower cased words. */
+size_t tokenize(const char *sentence, token_t **tokensp, char ***wordsp, size_t *nwords)
 {
-	json_parser_t *p = ctx;
-	void *valueptr;
+	token_t *tokens = NULL;
+	char **words = NULL;
+	size_t len = strlen(sentence), i = 0, ntokens = 0;
 
-	valueptr = json_get_valueptr(p);
-	if (valueptr == NULL)
-    	return 1;
+	*nwords = 0;
 
-	cyd_printf(LOG_DEBUG, NC, "json_string_multivalued: dest - 0x%x, data - %s, size - %d\n",
-			valueptr, data, size);
-	if (p->key->multivalued)
-		return json_string_multivalued(valueptr, data, size);
-	else
-		return json_string_singlevalued(valueptr, data, size);
+	while (i < len) {
+		token_t tok;
+		uint32_t cp;
+		size_t n = utf8_decode(sentence + i, len - i, &cp), j;
+		char *word;
+
+		if (!codepoint_is_word(cp) && !codepoint_is_cjk(cp)) {
+			i += n;
+			continue;
+		}
+
+		tok.text = sentence + i;
+		tok.len = n;
+		if (!codepoint_is_cjk(cp)) {
+			while (i + tok.len < len) {
+				size_t m = utf8_decode(sentence + i + tok.len, len - i - tok.len, &cp);
+				uint32_t next = 0;
+
+				/* keep apostrophes and hyphens inside a word */
+				if ((cp == '\'' || cp == '-') && i + tok.len + m < len)
+					utf8_decode(sentence + i + tok.len + m, len - i - tok.len - m, &next);
+				if (codepoint_is_word(cp) ||
+						((cp == '\'' || cp == '-') && codepoint_is_word(next)))
+					tok.len += m;
+				else
+					break;
+			}
+		}
+		i += tok.len;
+
+		n = tok.len;
+		tok.width = utf8_width(tok.text, &n, -1);
+
+		word = strndup(tok.text, tok.len);
+		if (word == NULL)
+			break;
+		for (j = 0; word[j]; j++)
+			if (word[j] >= 'A' && word[j] <= 'Z')
+				word[j] += 'a' - 'A';
+
+		for (j = 0; j < *nwords; j++)
+			if (streq(words[j], word))
+				break;
+		if (j == *nwords) {
+			char **newwords = realloc(words, (*nwords + 1) * sizeof(char *));
+			if (newwords == NULL) {
+				free(word);
+				break;
+			}
+			words = newwords;
+			words[(*nwords)++] = word;
+		} else
+			free(word);
+		tok.word = j;
+
+		token_t *newtokens = realloc(tokens, (ntokens + 1) * sizeof(token_t));
+		if (newtokens == NULL)
+			break;
+		tokens = newtokens;
+		tokens[ntokens++] = tok;
+	}
+
+	*tokensp = tokens;
+	*wordsp = words;
+
+	return ntokens;
 }
 
-int json_string_multivalued(list_t **dest, const unsigned char *data, size_t size)
+/* the shortest useful meaning of a word */
+const char *gloss_text(const result_t *result, const char *word)
 {
-	char *str;
+	const char *text;
 
-	str = strndup((const char *)data, size);
-	if (str == NULL)
-		return 0;
+	if (result == NULL || result_is_negative(result))
+		return NULL;
 
-	*dest = list_add(*dest, (unsigned char *)str);
+	/* untranslated words come back as themselves */
+	if (result->translation.count) {
+		text = result_strv(result, result->translation, 0);
+		if (strcasecmp(text, word) != 0)
+			return text;
+	}
 
-	return 1;
+	if (result->explains.count)
+		return result_strv(result, result->explains, 0);
+
+	return NULL;
 }
 
-int json_string_singlevalued(char **dest, const unsigned char *data, size_t size)
+int terminal_width(void)
 {
-	char *str;
+	struct winsize ws;
+	const char *columns;
 
-	str = strndup((const char *)data, size);
-	if (str == NULL)
-		return 0;
+	if (isatty(fileno(stdout)) && ioctl(fileno(stdout), TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		return ws.ws_col;
 
-	free(*dest);
-	*dest = str;
+	columns = getenv("COLUMNS");
+	if (columns && atoi(columns) > 0)
+		return atoi(columns);
 
-	return 1;
+	return 80;
 }
 
-int keycmp(const void *v1, const void *v2)
+void print_gloss_line(const token_t *tokens, size_t n, const char **glosses,
+		const int *widths)
 {
-	const struct key_t *k1 = v1;
-	const struct key_t *k2 = v2;
+	size_t i;
 
-	return strcmp(k1->name, k2->name);
+	cyd_printf(LOG_INFO, NC, "     ");
+	for (i = 0; i < n; i++) {
+		cyd_printf(LOG_INFO, YELLOW, "%.*s", (int)tokens[i].len, tokens[i].text);
+		cyd_printf(LOG_INFO, NC, "%*s", widths[i] - tokens[i].width + 2, "");
+	}
+	cyd_printf(LOG_INFO, NC, "\n     ");
+	for (i = 0; i < n; i++) {
+		const char *text = glosses[tokens[i].word];
+		size_t len = text ? strlen(text) : 1;
+		int width = text ? utf8_width(text, &len, GLOSS_MAX_WIDTH) : 1;
+
+		cyd_printf(LOG_INFO, MAGENTA, "%.*s", (int)len, text ? text : "-");
+		cyd_printf(LOG_INFO, NC, "%*s", widths[i] - width + 2, "");
+	}
+	cyd_printf(LOG_INFO, NC, "\n\n");
 }
 
-const struct key_t *string_to_key(const unsigned char *key, size_t len)
+/* words on one line, their meaning aligned underneath */
+void print_gloss(const token_t *tokens, size_t ntokens, const char **glosses)
 {
-	char keybuf[32];
-	struct key_t k;
+	_cleanup_free_ int *widths = NULL;
+	int columns = terminal_width() - 5, x = 0;
+	size_t i, start = 0;
 
-	snprintf(keybuf, len + 1, "%s", key);
+	widths = calloc(ntokens, sizeof(int));
+	if (widths == NULL)
+		return;
 
-	k.name = keybuf;
-	return bsearch(&k, json_keys, sizeof(json_keys) / sizeof(json_keys[0]),
-			sizeof(json_keys[0]), keycmp);
+	cyd_printf(LOG_INFO, CYAN, "   Gloss:\n");
+	for (i = 0; i < ntokens; i++) {
+		const char *text = glosses[tokens[i].word];
+		size_t len = text ? strlen(text) : 1;
+		int width = text ? utf8_width(text, &len, GLOSS_MAX_WIDTH) : 1;
+
+		widths[i] = tokens[i].width > width ? tokens[i].width : width;
+		if (x > 0 && x + widths[i] > columns) {
+			print_gloss_line(tokens + start, i - start, glosses, widths + start);
+			start = i;
+			x = 0;
+		}
+		x += widths[i] + 2;
+	}
+	if (start < ntokens)
+		print_gloss_line(tokens + start, ntokens - start, glosses, widths + start);
 }
 
-int cyd_asprintf(char **string, const char *format, ...)
+/* translate a sentence and gloss each of its words underneath */
+int gloss(CURL *curl, const char *sentence)
 {
+	_cleanup_free_ token_t *tokens = NULL;
+	_cleanup_free_ const char **lookups = NULL;
+	_cleanup_free_ const char **glosses = NULL;
+	_cleanup_free_ result_t **results = NULL;
+	char **words = NULL;
+	size_t ntokens, nwords, i;
 	int ret = 0;
-	va_list args;
 
-	va_start(args, format);
-	ret = vasprintf(string, format, args);
-	va_end(args);
+	ntokens = tokenize(sentence, &tokens, &words, &nwords);
+	if (ntokens <= 1) {
+		for (i = 0; i < nwords; i++)
+			free(words[i]);
+		free(words);
+		return query(curl, sentence);
+	}
 
-	if (ret == -1) {
-		cyd_fprintf(stderr, LOG_ERROR, "failed to allocate string\n");
+	/* the sentence itself goes out with its words */
+	lookups = calloc(nwords + 1, sizeof(char *));
+	glosses = calloc(nwords, sizeof(char *));
+	results = calloc(nwords + 1, sizeof(result_t *));
+	if (lookups && glosses && results) {
+		lookups[0] = sentence;
+		for (i = 0; i < nwords; i++)
+			lookups[i + 1] = words[i];
+
+		lookup_many(lookups, nwords + 1, results);
+
+		if (results[0])
+			print_explanation(results[0]);
+		else {
+			cyd_fprintf(stderr, LOG_ERROR, "no result from any backend for %s\n", sentence);
+			ret = -1;
+		}
+		for (i = 0; i < nwords; i++)
+			glosses[i] = gloss_text(results[i + 1], words[i]);
+		print_gloss(tokens, ntokens, glosses);
 	}
 
+	if (results)
+		for (i = 0; i <= nwords; i++)
+			mem_free(results[i]);
+	for (i = 0; i < nwords; i++)
+		free(words[i]);
+	free(words);
+
 	return ret;
 }
 
-size_t yajl_parse_stream(void *ptr, size_t size, size_t nmemb, void *stream)
+int lookup(CURL *curl, const char *word)
 {
-	struct yajl_handle_t *hand = stream;
-	size_t realsize = size * nmemb;
+	uint64_t start = now_usec();
+	int ret;
 
-	yajl_parse(hand, ptr, realsize);
+	metrics_inc(METRIC_LOOKUPS);
+	ret = cfg.gloss ? gloss(curl, word) : query(curl, word);
+	histogram_since(METRIC_LOOKUP, start);
 
-	return realsize;
+	mem_report(stdout, LOG_DEBUG);
+
+	return ret;
 }
 
-int query(CURL *curl, const char *word)
+/* print a result into a buffer of its own, on a worker */
+void render_task(void *arg)
 {
-	CURLcode curlstat;
-	struct yajl_handle_t *yajl_hand = NULL;
-	_cleanup_free_ char *escaped = NULL, *url = NULL;
-	long httpcode;
-	json_parser_t *json_parser;
-
-	json_parser = malloc(sizeof(json_parser_t));
-	memset(json_parser, 0, sizeof(json_parser_t));
-
-	yajl_hand = yajl_alloc(&callbacks, NULL, json_parser);
-
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, yajl_parse_stream);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, yajl_hand);
-
-	escaped = curl_easy_escape(curl, word, strlen(word));
-	if (escaped) {
-		cyd_printf(LOG_DEBUG, NC, "Encoded: %s\n", escaped);
+	render_job_t *job = arg;
+	FILE *out;
+
+	out = open_memstream(&job->out, &job->len);
+	if (out) {
+		cyd_out = out;
+		print_explanation(job->result);
+		cyd_out = NULL;
+		fclose(out);
 	}
 
-	cyd_asprintf(&url, YD_API_URL, API, API_KEY, API_VERSION, escaped);
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-
-	cyd_printf(LOG_DEBUG, NC, "curl_easy_perform %s\n", url);
-	curlstat = curl_easy_perform(curl);
+	latch_done(job->latch, &job->done);
+}
 
-	if (curlstat != CURLE_OK) {
-		cyd_fprintf(stderr, LOG_ERROR, "%s\n", curl_easy_strerror(curlstat));
-		return -1;
-	}
+/* look up all words at once and print them in order, rendering on the
+ * pool and writing each one out as soon as those before it are done */
+void lookup_batch(const char **words, size_t n)
+{
+	_cleanup_free_ result_t **results = NULL;
+	_cleanup_free_ render_job_t *jobs = NULL;
+	uint64_t start = now_usec();
+	latch_t latch;
+	size_t i;
+
+	results = calloc(n, sizeof(result_t *));
+	jobs = calloc(n, sizeof(render_job_t));
+	if (results == NULL || jobs == NULL)
+		return;
 
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
-	cyd_printf(LOG_DEBUG, NC, "server responded with %ld\n", httpcode);
-	if (httpcode >= 400) {
-		cyd_fprintf(stderr, LOG_ERROR, "error, server responded with HTTP %ld\n", httpcode);
-		return -1;
+	__atomic_fetch_add(&metrics.counters[METRIC_LOOKUPS], n, __ATOMIC_RELAXED);
+	lookup_many(words, n, results);
+
+	latch_init(&latch);
+	for (i = 0; i < n; i++) {
+		if (results[i] == NULL)
+			continue;
+		jobs[i].result = results[i];
+		jobs[i].latch = &latch;
+		latch_add(&latch);
+		pool_submit(render_task, &jobs[i]);
 	}
 
-	yajl_complete_parse(yajl_hand);
-
-	print_explanation(json_parser);
-
-	yajl_free(yajl_hand);
+	for (i = 0; i < n; i++) {
+		if (results[i] == NULL) {
+			cyd_fprintf(stderr, LOG_ERROR, "no result from any backend for %s\n", words[i]);
+			continue;
+		}
 
-	json_parser_free(json_parser);
+		latch_wait(&latch, &jobs[i].done);
+		if (jobs[i].out)
+			fwrite(jobs[i].out, 1, jobs[i].len, stdout);
+		else
+			print_explanation(results[i]);
+		free(jobs[i].out);
+		mem_free(results[i]);
+		histogram_since(METRIC_LOOKUP, start);
+	}
+	latch_destroy(&latch);
 
-	return 0;
+	mem_report(stdout, LOG_DEBUG);
 }
 
-void print_explanation(json_parser_t *parser)
+void print_explanation(const result_t *result)
 {
+	uint64_t start = now_usec();
 	int has_result = 0;
-	cyd_printf(LOG_INFO, UNDERLINE, "%s", parser->query);
-	if (parser->basic_dic != NULL) {
+	uint32_t i;
+
+	cyd_printf(LOG_INFO, UNDERLINE, "%s", result_str(result, result->query));
+	if (result->flags & RESULT_HAS_BASIC) {
 		has_result = 1;
-		basic_dic_t *dic = parser->basic_dic;
-		if (dic->uk_phonetic && dic->us_phonetic) {
-			// cyd_printf(LOG_INFO, NC, " UK: [%s], US: [%s]\n", dic->uk_phonetic, dic->us_phonetic);
+		const char *uk_phonetic = result_str(result, result->uk_phonetic);
+		const char *us_phonetic = result_str(result, result->us_phonetic);
+		const char *phonetic = result_str(result, result->phonetic);
+		if (uk_phonetic && us_phonetic) {
+			// cyd_printf(LOG_INFO, NC, " UK: [%s], US: [%s]\n", uk_phonetic, us_phonetic);
 			cyd_printf(LOG_INFO, NC, " UK: [");
-			cyd_printf(LOG_INFO, YELLOW, "%s", dic->uk_phonetic);
+			cyd_printf(LOG_INFO, YELLOW, "%s", uk_phonetic);
 			cyd_printf(LOG_INFO, NC, "], US: [");
-			cyd_printf(LOG_INFO, YELLOW, "%s", dic->us_phonetic);
+			cyd_printf(LOG_INFO, YELLOW, "%s", us_phonetic);
 			cyd_printf(LOG_INFO, NC, "]\n");
-		} else if (dic->phonetic) {
-			// cyd_printf(LOG_INFO, NC, " [%s]\n", dic->phonetic);
+		} else if (phonetic) {
+			// cyd_printf(LOG_INFO, NC, " [%s]\n", phonetic);
 			cyd_printf(LOG_INFO, NC, " [");
-			cyd_printf(LOG_INFO, YELLOW, "%s", dic->phonetic);
+			cyd_printf(LOG_INFO, YELLOW, "%s", phonetic);
 			cyd_printf(LOG_INFO, NC, "]\n");
 		} else
 			cyd_printf(LOG_INFO, NC, "\n");
 
 		if (cfg.speech) {
-			if (dic->uk_speech && dic->us_speech) {
+			const char *uk_speech = result_str(result, result->uk_speech);
+			const char *us_speech = result_str(result, result->us_speech);
+			const char *speech = result_str(result, result->speech);
+			if (uk_speech && us_speech) {
 				cyd_printf(LOG_INFO, CYAN, "  Text to Speech:\n");
-				cyd_printf(LOG_INFO, NC, "     * UK: %s\n", dic->uk_speech);
-				cyd_printf(LOG_INFO, NC, "     * US: %s\n", dic->us_speech);
-			} else if (dic->speech)
-				cyd_printf(LOG_INFO, NC, "     * %s\n", dic->speech);
+				cyd_printf(LOG_INFO, NC, "     * UK: %s\n", uk_speech);
+				cyd_printf(LOG_INFO, NC, "     * US: %s\n", us_speech);
+			} else if (speech)
+				cyd_printf(LOG_INFO, NC, "     * %s\n", speech);
 			cyd_printf(LOG_INFO, NC, "\n");
 		}
 
-		if (dic->explains) {
+		if (result->explains.count) {
 			cyd_printf(LOG_INFO, CYAN, "   Word Explanation:\n");
-			list_t *curr = dic->explains;
-			while (curr->data) {
-				cyd_printf(LOG_INFO, NC, "     * %s\n", (unsigned char *)curr->data);
-				if (curr->next)
-					curr = curr->next;
-				else
-					break;
-			}
+			for (i = 0; i < result->explains.count; i++)
+				cyd_printf(LOG_INFO, NC, "     * %s\n", result_strv(result, result->explains, i));
 		} else
 			cyd_printf(LOG_INFO, NC, "\n");
-	} else if (parser->translation) {
+	} else if (result->translation.count) {
 		has_result = 1;
 		cyd_printf(LOG_INFO, CYAN, "\n  Translation:\n");
-		list_t *curr = parser->translation;
-		while (curr->data) {
-			cyd_printf(LOG_INFO, NC, "     * %s\n", (unsigned char *)curr->data);
-			if (curr->next)
-				curr = curr->next;
-			else
-				break;
-		}
+		for (i = 0; i < result->translation.count; i++)
+			cyd_printf(LOG_INFO, NC, "     * %s\n", result_strv(result, result->translation, i));
 	} else
 		cyd_printf(LOG_INFO, NC, "\n");
 
-	if (cfg.out_full && parser->web_dic_list) {
+	if (cfg.out_full && result->web.count) {
 		has_result = 1;
 		cyd_printf(LOG_INFO, CYAN, "\n   Web Reference:\n");
-		list_t *list = parser->web_dic_list;
-		while (list) {
-			web_dic_t *web = list->data;
-			// cyd_printf(LOG_INFO, NC, "     * %s\n", web->key);
+		for (i = 0; i < result->web.count; i++) {
+			const result_web_t *web = result_web(result, i);
+			uint32_t j;
+			// cyd_printf(LOG_INFO, NC, "     * %s\n", result_str(result, web->key));
 			cyd_printf(LOG_INFO, NC, "     * ");
-			cyd_printf(LOG_INFO, YELLOW, "%s\n", web->key);
-			list_t *curr = web->value;
+			cyd_printf(LOG_INFO, YELLOW, "%s\n", result_str(result, web->key));
 			// print values in the same line
 			cyd_printf(LOG_INFO, NC, "      ");
-			while (curr) {
-				// cyd_printf(LOG_INFO, NC, " %s;", (unsigned char *)curr->data);
-				cyd_printf(LOG_INFO, MAGENTA, " %s", curr->data);
-				if (curr->next) {
+			for (j = 0; j < web->value.count; j++) {
+				// cyd_printf(LOG_INFO, NC, " %s;", result_strv(result, web->value, j));
+				cyd_printf(LOG_INFO, MAGENTA, " %s", result_strv(result, web->value, j));
+				if (j + 1 < web->value.count)
 					cyd_printf(LOG_INFO, NC, ";");
-					curr = curr->next;
-				}
-				else
-					break;
 			}
 			cyd_printf(LOG_INFO, NC, "\n");
-
-			if (list->next)
-				list = list->next;
-			else
-				break;
 		}
 	}
 
@@ -703,11 +4511,13 @@ void print_explanation(json_parser_t *parser)
 		cyd_printf(LOG_INFO, NC, " -- No result for this query.\n");
 
 	cyd_printf(LOG_INFO, NC, "\n");
+
+	histogram_since(METRIC_RENDER, start);
 }
 
 void usage(void)
 {
-	fprintf(stderr, "usage: cydcv [-h] [-f] [-s] [-S] [-x] [--color {always,auto,never}]\n");
+	fprintf(stderr, "usage: cydcv [-h] [-f] [-s] [-S] [-x] [-g] [--color {always,auto,never}]\n");
 	fprintf(stderr, "             [words [words ...]]\n\n");
 	fprintf(stderr, "Youdao Console Version\n\n");
 	fprintf(stderr,
@@ -722,10 +4532,33 @@ void usage(void)
 			"                        effect\n"
 			"  -S, --speech          print URL to speech audio.\n"
 			"  -x, --selection       show explaination of current selection.\n"
+			"  -g, --gloss           also look up every word of a sentence and print\n"
+			"                        their meanings underneath.\n"
 			"  -c, --color {always,auto,never}\n"
 			"                        colorize the output. Default to 'auto' or can be\n"
 			"                        'never' or 'always'.\n"
-			"  --debug               show debug info\n\n");
+			"  --cache-file FILE     shared result cache, defaults to\n"
+			"                        $XDG_CACHE_HOME/cydcv/cache\n"
+			"  --mem-stats           print live memory per subsystem on exit\n"
+			"  --backend LIST        comma separated backends to look words up in:\n"
+			"                        'youdao', 'index:FILE', 'replay:FILE' or\n"
+			"                        'mock[:DELAY_MS[:FAIL_EVERY]]'.\n"
+			"                        Default to 'youdao'.\n"
+			"  --jobs N              threads parsing and printing batched lookups,\n"
+			"                        1 does it all on the main thread. Default to\n"
+			"                        the number of CPUs, at most %d.\n"
+			"  --metrics-file FILE   rewrite FILE with Prometheus metrics every\n"
+			"                        %d seconds\n"
+			"  --metrics-socket PATH serve Prometheus metrics on a unix socket\n"
+			"  --record FILE         append every API response to the corpus FILE\n"
+			"  --replay FILE         answer from responses recorded in FILE, before\n"
+			"                        any --backend and without the shared cache.\n"
+			"  --route {fastest,fanout}\n"
+			"                        try backends one at a time, fastest first, or\n"
+			"                        all at once taking the first good answer.\n"
+			"                        Batched and glossed lookups always go\n"
+			"                        fastest first. Default to 'fastest'.\n"
+			"  --debug               show debug info\n\n", POOL_MAX_WORKERS, METRICS_INTERVAL);
 }
 
 int parse_options(int argc, char **argv)
@@ -738,14 +4571,24 @@ int parse_options(int argc, char **argv)
 		{"simple",		no_argument,		0, 's'},
 		{"speech",		no_argument,		0, 'S'},
 		{"selection",	no_argument,		0, 'x'},
+		{"gloss",		no_argument,		0, 'g'},
 		{"color",		optional_argument,	0, 'c'},
+		{"cache-file",	required_argument,	0, OP_CACHE_FILE},
+		{"mem-stats",	no_argument,		0, OP_MEM_STATS},
+		{"backend",		required_argument,	0, OP_BACKEND},
+		{"route",		required_argument,	0, OP_ROUTE},
+		{"metrics-file",	required_argument,	0, OP_METRICS_FILE},
+		{"metrics-socket",	required_argument,	0, OP_METRICS_SOCKET},
+		{"jobs",		required_argument,	0, OP_JOBS},
+		{"record",		required_argument,	0, OP_RECORD},
+		{"replay",		required_argument,	0, OP_REPLAY},
 		{"debug",		no_argument,		0, OP_DEBUG},
 		{"verbose",		no_argument,		0, OP_VERBOSE},
 		{"help",		no_argument,		0, 'h'},
 		{0,				0,					0, 0},
 	};
 
-	while((opt = getopt_long(argc, argv, "fsSxch", opts, &option_index)) != -1) {
+	while((opt = getopt_long(argc, argv, "fsSxgch", opts, &option_index)) != -1) {
 		cyd_printf(LOG_DEBUG, NC, "parse_options: opt - 0x%x\n", opt);
 		switch (opt) {
 			/* options */
@@ -761,6 +4604,9 @@ int parse_options(int argc, char **argv)
 			case 'x':
 				cfg.selection = 1;
 				break;
+			case 'g':
+				cfg.gloss = 1;
+				break;
 			case 'c':
 				if(!optarg || streq(optarg, "auto")) {
 					if(isatty(fileno(stdout))) {
@@ -777,6 +4623,50 @@ int parse_options(int argc, char **argv)
 					return 1;
 				}
 				break;
+			case OP_CACHE_FILE:
+				free(cfg.cache_file);
+				cfg.cache_file = strdup(optarg);
+				break;
+			case OP_MEM_STATS:
+				cfg.mem_stats = 1;
+				break;
+			case OP_BACKEND:
+				free(cfg.backends);
+				cfg.backends = strdup(optarg);
+				break;
+			case OP_ROUTE:
+				if (streq(optarg, "fastest")) {
+					cfg.route = ROUTE_FASTEST;
+				} else if (streq(optarg, "fanout")) {
+					cfg.route = ROUTE_FANOUT;
+				} else {
+					fprintf(stderr, "invalid argument to --route\n");
+					return 1;
+				}
+				break;
+			case OP_METRICS_FILE:
+				free(cfg.metrics_file);
+				cfg.metrics_file = strdup(optarg);
+				break;
+			case OP_METRICS_SOCKET:
+				free(cfg.metrics_socket);
+				cfg.metrics_socket = strdup(optarg);
+				break;
+			case OP_JOBS:
+				cfg.jobs = atoi(optarg);
+				if (cfg.jobs < 1) {
+					fprintf(stderr, "invalid argument to --jobs\n");
+					return 1;
+				}
+				break;
+			case OP_RECORD:
+				free(cfg.record);
+				cfg.record = strdup(optarg);
+				break;
+			case OP_REPLAY:
+				free(cfg.replay);
+				cfg.replay = strdup(optarg);
+				break;
 			case OP_VERBOSE:
 				cfg.logmask |= LOG_VERBOSE;
 			/* fall through
@@ -813,6 +4703,11 @@ int main(int argc, char **argv)
 	cfg.color = 0;
 	cfg.selection = 0;
 	cfg.speech = 0;
+	cfg.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cfg.jobs < 1)
+		cfg.jobs = 1;
+	if (cfg.jobs > POOL_MAX_WORKERS)
+		cfg.jobs = POOL_MAX_WORKERS;
 
 	if (isatty(fileno(stdout)))
 		cfg.color = 1;
@@ -824,8 +4719,48 @@ int main(int argc, char **argv)
 		return ret;
 	}
 
+	if (cfg.replay) {
+		char *backends = NULL;
+
+		if (cyd_asprintf(&backends, "replay:%s%s%s", cfg.replay,
+					cfg.backends ? "," : "", cfg.backends ? cfg.backends : "") == -1)
+			return 1;
+		free(cfg.backends);
+		cfg.backends = backends;
+	}
+
+	if (router_init(cfg.backends ? cfg.backends : "youdao") < 0)
+		return 1;
+	if (cfg.replay)
+		((backend_t *)router.backends->data)->pinned = true;
+
+	if (cfg.record) {
+		corpus = store_open(cfg.record, 0);
+		if (corpus == NULL) {
+			cyd_fprintf(stderr, LOG_ERROR, "failed to open corpus %s\n", cfg.record);
+			return 1;
+		}
+	}
+
+	/* a replay should not be answered by whatever was cached live */
+	if (cfg.cache_file) {
+		cache.store = store_open(cfg.cache_file, STORE_OPEN_RECREATE);
+	} else if (cfg.replay == NULL) {
+		cfg.cache_file = store_default_path();
+		if (cfg.cache_file)
+			cache.store = store_open(cfg.cache_file, STORE_OPEN_RECREATE | STORE_OPEN_OWNED);
+	}
+
+	if (metrics_start() < 0)
+		return 1;
+
+	/* only batches have CPU work worth handing off */
+	if (cfg.gloss || (cfg.words && cfg.words->next))
+		pool_init(cfg.jobs);
+
 	cyd_printf(LOG_DEBUG, NC, "initializing curl\n");
-	curl_global_init(CURL_GLOBAL_ALL);
+	curl_global_init_mem(CURL_GLOBAL_ALL, curl_mem_malloc, mem_free, curl_mem_realloc,
+			curl_mem_strdup, curl_mem_calloc);
 	CURL *curl = curl_easy_init();
 
 	if (curl == NULL)
@@ -835,10 +4770,26 @@ int main(int argc, char **argv)
 	}
 
  	list_t *word = cfg.words;
+	if (word && word->next && !cfg.gloss && pool.nworkers > 0) {
+		_cleanup_free_ const char **words = NULL;
+		size_t n = 0;
+
+		for (; word; word = word->next)
+			n++;
+		words = calloc(n, sizeof(char *));
+		if (words) {
+			n = 0;
+			for (word = cfg.words; word; word = word->next)
+				words[n++] = word->data;
+			lookup_batch(words, n);
+			goto done;
+		}
+		word = cfg.words;
+	}
 	while (word) {
 		cyd_printf(LOG_DEBUG, NC, "word to translate: %s\n", word->data);
 
-		query(curl, word->data);
+		lookup(curl, word->data);
 
 		if (word->next)
 			word = word->next;
@@ -849,43 +4800,67 @@ int main(int argc, char **argv)
 	if (word == NULL) {
 		if (cfg.selection) {
 			FILE *file;
-			char last[128], curr[128];
+			char last[128] = "", curr[128] = "";
 
 			file = popen("xsel", "r");
 			cyd_printf(LOG_INFO, NC, "Waiting for selection>\n");
-			fgets(last, 128, file);
-			fclose(file);
+			if (file) {
+				fgets(last, 128, file);
+				pclose(file);
+			}
 			while (1) {
 				sleep(1);
 				file = popen("xsel", "r");
+				if (file == NULL)
+					continue;
 				fgets(curr, 128, file);
-				fclose(file);
+				pclose(file);
 				if (streq(last, curr) == 0) {
 					memcpy(last, curr, 128);
-					query(curl, last);
+					lookup(curl, last);
 					cyd_printf(LOG_INFO, NC, "Waiting for selection>\n");
 				}
 			}
 			goto done;
 		}
+		stifle_history(HISTORY_MAX);
 		while (1) {
 			char *line = readline("> ");
-			add_history(line);
+			if (line && *line)
+				add_history(line);
 			if (line == NULL) {
 				printf("\nBye\n");
 				break;
 			} else {
-				query(curl, line);
+				lookup(curl, line);
 				free(line);
 			}
 		}
 	}
 
 done:
+	pool_free();
+	cache_drain();
+	metrics_stop();
+	router_free();
+	cache_clear();
+	store_close(cache.store);
+	store_close(corpus);
+	FREE_STRING_LIST(cfg.words);
+	free(cfg.cache_file);
+	free(cfg.backends);
+	free(cfg.metrics_file);
+	free(cfg.metrics_socket);
+	free(cfg.record);
+	free(cfg.replay);
+
 	curl_easy_cleanup(curl);
 
 	curl_global_cleanup();
 
+	if (cfg.mem_stats)
+		mem_report(stderr, LOG_INFO);
+
 	return 0;
 }
 
@@ -0,0 +1,99 @@
+/* A long session in fast forward: a million lookups of a rotating
+ * vocabulary much larger than the cache, answered by the mock backend,
+ * which fails every SOAK_FAIL_EVERY lookups with no answer, an error
+ * page or an API error. Fails if the resident set keeps growing once
+ * the cache is full, or if any tracked memory is left behind at the end. */
+#define main cydcv_main
+#include "../cydcv.c"
+#undef main
+
+#define SOAK_LOOKUPS	1000000
+#define SOAK_WARMUP		100000
+#define SOAK_WORDS		50000
+#define SOAK_FAIL_EVERY	"7"
+/* allowed growth after warmup, for allocator slack */
+#define SOAK_SLACK		(4 << 20)
+
+size_t soak_rss(void)
+{
+	unsigned long size, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if (statm == NULL)
+		return 0;
+	if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+size_t soak_negative(void)
+{
+	cache_entry_t *entry;
+	size_t n = 0;
+
+	for (entry = cache.head; entry; entry = entry->next)
+		n += entry->negative;
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	size_t warm = 0, peak = 0, failed = 0, negative = 0, rss;
+	char word[32];
+	int i, leaked = 0;
+
+	cfg.logmask = LOG_ERROR|LOG_WARN|LOG_INFO;
+	cfg.out_full = 1;
+
+	/* print as usual, into nowhere, errors for failed lookups included */
+	cyd_out = fopen("/dev/null", "w");
+	if (cyd_out == NULL || freopen("/dev/null", "w", stderr) == NULL ||
+			router_init("mock:0:" SOAK_FAIL_EVERY) < 0)
+		return 1;
+
+	for (i = 0; i < SOAK_LOOKUPS; i++) {
+		snprintf(word, sizeof(word), "word%d", (int)((i * 7919L) % SOAK_WORDS));
+		if (lookup(NULL, word) < 0)
+			failed++;
+
+		if (i + 1 == SOAK_WARMUP)
+			warm = soak_rss();
+		if (i + 1 > SOAK_WARMUP && (i + 1) % SOAK_WARMUP == 0) {
+			rss = soak_rss();
+			if (rss > peak)
+				peak = rss;
+			negative = soak_negative();
+			printf("%d lookups: rss %zu KiB, cache %zu entries, %zu negative, "
+					"%zu bytes, %zu failed\n", i + 1, rss >> 10, cache.count,
+					negative, mem_live[MEM_CACHE], failed);
+		}
+	}
+
+	cache_drain();
+	router_free();
+	cache_clear();
+	fclose(cyd_out);
+	cyd_out = NULL;
+
+	for (i = 0; i < MEM_SUBSYS_MAX; i++) {
+		if (mem_live[i] != 0) {
+			printf("%s: %zu bytes still live\n", mem_subsys_names[i], mem_live[i]);
+			leaked = 1;
+		}
+	}
+
+	printf("rss after warmup %zu KiB, peak %zu KiB\n", warm >> 10, peak >> 10);
+	if (failed == 0 || negative == 0) {
+		printf("no lookup failed, the error paths did not run\n");
+		return 1;
+	}
+	if (warm == 0 || peak > warm + SOAK_SLACK) {
+		printf("resident set kept growing\n");
+		return 1;
+	}
+
+	return leaked;
+}
@@ -0,0 +1,219 @@
+/* Several processes hammer one shared store: writers append, readers
+ * check every record they find, compactors rewrite the file under them
+ * and caches go through the cache layer, compacting on its thread.
+ * Fails if any process reads a record that does not match its key, or
+ * if a lookup of a key that was stored finds nothing at the end. */
+#define main cydcv_main
+#include "../cydcv.c"
+#undef main
+
+#include <sys/wait.h>
+
+#define STRESS_WRITERS		3
+#define STRESS_READERS		3
+#define STRESS_COMPACTORS	2
+#define STRESS_CACHES		2
+#define STRESS_KEYS			20000
+#define STRESS_ROUNDS		40000
+
+/* values are long and repetitive enough to be deflated now and then */
+size_t stress_value(const char *key, unsigned round, char *buf, size_t size)
+{
+	size_t len = 0, reps = 1 + round % 24;
+
+	while (reps-- && len + 64 < size)
+		len += snprintf(buf + len, size - len, "value-of-%s;", key);
+
+	return len;
+}
+
+/* pack like cache_persist does, so both kinds of record are exercised */
+void stress_put(store_t *store, const char *key, const char *value, size_t len)
+{
+	char *packed;
+	size_t packedlen = store_deflate(value, len, &packed);
+
+	if (packedlen > 0)
+		store_put(store, key, packed, packedlen, time(NULL), 0, STORE_DEFLATE);
+	else
+		store_put(store, key, value, len, time(NULL), 0, 0);
+	free(packed);
+}
+
+bool stress_check(const store_record_t *rec, const char *key)
+{
+	char *data;
+	size_t len, keylen = strlen(key), prefix = strlen("value-of-");
+	bool ok;
+
+	data = (char *)store_record_copy(rec, MEM_CACHE, &len);
+	if (data == NULL)
+		return false;
+
+	ok = len >= prefix + keylen + 1 && strncmp(data, "value-of-", prefix) == 0 &&
+		strncmp(data + prefix, key, keylen) == 0 && data[prefix + keylen] == ';';
+	mem_free(data);
+
+	return ok;
+}
+
+void stress_compact(store_t **storep)
+{
+	store_t *newstore = store_compact(*storep, time(NULL));
+
+	if (newstore) {
+		store_catch_up(*storep, newstore);
+		store_retire(*storep);
+		store_close(*storep);
+		*storep = newstore;
+	}
+}
+
+int stress_child(const char *path, int role, int id)
+{
+	store_t *store = store_open(path, STORE_OPEN_RECREATE);
+	char key[64], value[1024];
+	unsigned i, bad = 0, hits = 0;
+
+	if (store == NULL)
+		return 2;
+
+	srand(id);
+	for (i = 0; i < STRESS_ROUNDS; i++) {
+		const store_record_t *rec;
+
+		store_refresh(&store);
+		if (store == NULL)
+			return 2;
+
+		snprintf(key, sizeof(key), "word%d", rand() % STRESS_KEYS);
+		switch (role) {
+			case 0:
+				stress_put(store, key, value, stress_value(key, i, value, sizeof(value)));
+				/* like cache_persist, writers compact a store that is filling up */
+				if (store_needs_compaction(store))
+					stress_compact(&store);
+				break;
+			case 1:
+				rec = store_get(store, key);
+				if (rec) {
+					hits++;
+					if (!stress_check(rec, key))
+						bad++;
+				}
+				usleep(50);
+				break;
+			case 2:
+				if (i % 2000 == 0 || store_needs_compaction(store))
+					stress_compact(&store);
+				usleep(100);
+				break;
+		}
+	}
+
+	printf("%s %d: hits %u, bad %u, live %lu, slots %u\n",
+			role == 0 ? "writer" : role == 1 ? "reader" : "compactor", id,
+			hits, bad, (unsigned long)store->hdr->live, store->hdr->nslots);
+	store_close(store);
+
+	return bad ? 1 : 0;
+}
+
+/* what a cydcv process does: look words up, write the misses through
+ * and let cache_persist compact in the background, with the store being
+ * compacted and retired by the other processes at the same time */
+int stress_cache(const char *path, int id)
+{
+	backend_t remote = { .name = "youdao" };
+	time_t now = time(NULL);
+	char key[64];
+	unsigned i, hits = 0, bad = 0;
+
+	cache.store = store_open(path, STORE_OPEN_RECREATE);
+	if (cache.store == NULL)
+		return 2;
+
+	srand(id);
+	for (i = 0; i < STRESS_ROUNDS; i++) {
+		backend_t mock = { .name = "mock", .local = true };
+		result_t *result;
+
+		/* start a background compaction every hundred rounds, as
+		 * cache_persist does when the store fills up */
+		if (i % 100 == 0) {
+			now += CACHE_COMPACT_INTERVAL;
+			pthread_mutex_lock(&cache.lock);
+			cache_compact(now);
+			pthread_mutex_unlock(&cache.lock);
+		}
+
+		snprintf(key, sizeof(key), "cache%d", rand() % STRESS_KEYS);
+		result = cache_lookup(key, now);
+		if (result) {
+			hits++;
+			if (!result_is_good(result))
+				bad++;
+			mem_free(result);
+			continue;
+		}
+
+		result = mock_lookup(&mock, NULL, key);
+		if (result)
+			cache_insert(key, result, &remote, now);
+	}
+
+	cache_drain();
+	printf("cache %d: hits %u, bad %u, live %lu, slots %u\n", id, hits, bad,
+			(unsigned long)cache.store->hdr->live, cache.store->hdr->nslots);
+	cache_clear();
+	store_close(cache.store);
+
+	return bad ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "store_stress.db";
+	int roles[] = { STRESS_WRITERS, STRESS_READERS, STRESS_COMPACTORS, STRESS_CACHES };
+	int role, i, id = 0, status, failed = 0;
+	unsigned found = 0, bad = 0;
+	store_t *store;
+	char key[64];
+
+	cfg.logmask = LOG_ERROR|LOG_WARN;
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	unlink(path);
+
+	for (role = 0; role < 4; role++) {
+		for (i = 0; i < roles[role]; i++, id++) {
+			pid_t pid = fork();
+
+			if (pid < 0)
+				return 1;
+			if (pid == 0)
+				_exit(role == 3 ? stress_cache(path, id) : stress_child(path, role, id));
+		}
+	}
+
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+
+	/* whatever survived the compactions must still be intact */
+	store = store_open(path, 0);
+	if (store == NULL)
+		return 1;
+	for (i = 0; i < STRESS_KEYS; i++) {
+		const store_record_t *rec;
+
+		snprintf(key, sizeof(key), "word%d", i);
+		rec = store_get(store, key);
+		if (rec && ++found && !stress_check(rec, key))
+			bad++;
+	}
+	printf("final: found %u of %d keys, bad %u\n", found, STRESS_KEYS, bad);
+	store_close(store);
+	unlink(path);
+
+	return failed || bad || found == 0;
+}